@@ -40,17 +40,89 @@ typedef struct _spi_message {
  uint8_t rr_code;
  uint8_t rr_id;
  x10_bitstream_t x10_data;
+ uint16_t rx_seq; // received bits counter, lets the host notice overruns
  uint16_t crc16;
 } spi_message_t;
 
 #define REQUEST_POLL 0
 #define REQUEST_CANCEL 1
 #define REQUEST_TRANSMIT 2
+#define REQUEST_DELTA 3
+
+// DELTA reply: rr_code, rr_id, rx_seq, count, data[count], crc16
+#define DELTA_HEADER 5
+#define DELTA_MAX_OCTETS (X10_BITSTREAM_OCTETS-1)
+
+#define REQUEST_SEND 5
+
+// SEND request: a single command, expanded into frames on the fly.
+// It follows rr_code and rr_id, then comes crc16; the rest of the
+// message is not clocked.
+typedef struct _x10_send {
+ uint8_t code; // house code << 4 | unit code, as on the line
+ uint8_t function; // function code << 4 | SEND_STICKY
+ uint8_t addr_rpt;
+ uint8_t func_rpt;
+ uint8_t x_byte_1;
+ uint8_t x_byte_2;
+} x10_send_t;
+
+#define SEND_LENGTH (2+sizeof(x10_send_t)+2)
+#define SEND_STICKY 0x01 // no pause after the function frames
+
+#define X10_EXTENDED_CODE 0b0111
+
+#define REQUEST_QUEUE 6
+
+// QUEUE reply: rr_code, rr_id, slots, free slots, count,
+// count * (rr_id, status), crc16
+#define QUEUE_HEADER 5
+
+// SEND commands waiting for transmission, the first one is transmitted.
+// They share RAM with the TRANSMIT bitstream, see tx below.
+#define TX_SLOTS 3
 
 #define RESPONSE_SEEN 1
 #define RESPONSE_INPROGRESS 2
 #define RESPONSE_COMPLETE 3
 
+// Decode X10 frames on the chip, for COMMANDS requests. This is a
+// prototype for the firmware simulator of the host only: it needs 40
+// bytes more RAM, 138 in all, and the ATtiny26 has 128.
+//#define X10_DECODE
+
+#ifdef X10_DECODE
+
+#ifndef X10_SIM
+#error "X10_DECODE does not fit the RAM of the ATtiny26"
+#endif
+
+#define REQUEST_COMMANDS 4
+
+// COMMANDS reply: rr_code, rr_id, record counter, first record, count,
+// records[count], crc16
+#define CMD_HEADER 5
+
+// Decoded frame, as sent in COMMANDS replies
+typedef struct _x10_cmd_record {
+ uint8_t code; // house code << 4 | unit or function code, as on the line
+ uint8_t flags; // CMD_FUNCTION, CMD_EXTENDED and repetitions
+ uint8_t x_byte_1; // extended code data
+ uint8_t x_byte_2; // extended code command
+} x10_cmd_record_t;
+
+#define CMD_FUNCTION 0x80
+#define CMD_EXTENDED 0x40 // code holds the unit, the function is extended
+#define CMD_REPEATS 0x3F
+
+// Must be a power of 2. The slot after the newest record holds the frame
+// which may still repeat, and the one after it may be rewritten during a
+// reply, so a reply carries at most X10_CMD_SLOTS-2 records.
+#define X10_CMD_SLOTS 8
+#define X10_CMD_REPLY (X10_CMD_SLOTS-2)
+
+#endif
+
 
 typedef struct _struct_spi_status {
  uint8_t running : 1;
@@ -58,6 +130,9 @@ typedef struct _struct_spi_status {
  uint8_t rx_done : 1;
  uint8_t rx_enabled : 1;
  uint8_t tx_enabled : 1;
+ uint8_t delta : 1; // the reply is computed, see spi_delta
+ uint8_t commands : 1; // by spi_cmds_step(), not spi_delta_step()
+ uint8_t queue : 1; // by spi_queue_step()
 } spi_status_t;
 
 volatile spi_status_t spi_status;
@@ -65,14 +140,88 @@ volatile spi_status_t spi_status;
 volatile spi_message_t spi_rx_message;
 spi_message_t spi_tx_message;
 
-x10_bitstream_t tx_bitstream; // currently transmitted
+// The next state of spi_tx_message. A pass of the main loop gathers it
+// in a local, and spi_tx_commit() puts it in between SPI transactions,
+// so the host never clocks out a half-updated message. There is no RAM
+// for a second whole message, nor for keeping this between the passes.
+typedef struct _spi_tx_next {
+ uint8_t rr_code;
+ uint8_t rr_id;
+ uint8_t octet; // received X10 octet to append to the ring
+ uint8_t has_octet : 1;
+ uint8_t dirty : 1; // differs from spi_tx_message
+} spi_tx_next_t;
+
+// Phases of a SEND command
+#define SEND_ADDRESS 0
+#define SEND_ADDRESS_GAP 1
+#define SEND_FUNCTION 2
+#define SEND_FUNCTION_GAP 3
+#define SEND_DONE 4
+
+// Currently transmitted: a bitstream, or a queue of commands, the first
+// of them being expanded
+union {
+ x10_bitstream_t bits;
+ struct _x10_send_state {
+  uint8_t phase;
+  uint8_t repeats; // frames left in the phase
+  uint8_t pos; // next bit of the frame or the pause
+  struct _x10_tx_slot {
+   uint8_t rr_id;
+   x10_send_t cmd;
+  } slot[TX_SLOTS];
+ } send;
+} tx;
+
+// The queue in tx.send. It is empty while a bitstream is transmitted.
+// Nothing is transmitted while it is empty and raw is not set.
+volatile struct _tx_fifo {
+ uint8_t head : 2; // slot being transmitted
+ uint8_t count : 2;
+ uint8_t raw : 1; // tx holds a TRANSMIT bitstream
+ uint8_t postponed : 1; // spi_rx_message holds a request to chain
+} tx_fifo;
 
 uint8_t spi_counter; // counts bytes in a SPI transaction, up to spi_message size
 
+// State of a DELTA reply, prepared one octet ahead.
+// COMMANDS and QUEUE replies use it as well. spi_tx_message does not
+// change while the host clocks it, see spi_tx_commit().
+struct _spi_delta {
+ uint8_t next; // octet to send after the current one
+ uint8_t index; // ring index of the next data octet
+ uint8_t count; // data octets in the reply
+ uint16_t crc;
+} spi_delta;
+
 volatile uint8_t x10_rx;
 volatile uint8_t x10_tx;
-volatile uint8_t x10_rx_counter = 0;
-volatile uint8_t x10_tx_counter = 0;
+// Bits sampled to x10_rx, and bits of x10_tx left to send. Both count
+// up to 8, so they share an octet.
+volatile struct _x10_counter {
+ uint8_t rx : 4;
+ uint8_t tx : 4;
+} x10_counter;
+
+#ifdef X10_DECODE
+// Records up to x10_cmd_seq are published, the slot of x10_cmd_seq
+// holds the last frame while it may still repeat (x10_dec.open).
+x10_cmd_record_t x10_cmds[X10_CMD_SLOTS];
+uint8_t x10_cmd_seq;
+
+#define DEC_IDLE 0
+#define DEC_FRAME 1
+#define DEC_RECOVER 2
+
+struct _x10_decoder {
+ uint32_t code; // frame being received, deinterleaved
+ uint8_t shift; // recent bits, as received
+ uint8_t count; // bits since the start code, or since the last frame
+ uint8_t state : 2;
+ uint8_t open : 1; // the slot of x10_cmd_seq holds a frame
+} x10_dec;
+#endif
 
 static void spi_enable(void) {
  // 3-wire mode, external clock, shift on positive edge (SPI mode 0)
@@ -100,6 +249,7 @@ static void spi_disable(void) {
  // and SPI is disabled
  USICR = 0;
  spi_status.running = 0;
+ spi_status.delta = 0;
  if (spi_status.rx_body && spi_status.rx_enabled) {
   spi_status.rx_done = 1;
  }
@@ -119,6 +269,200 @@ ISR(IO_PINS_vect) {
  }
 }
 
+/*
+ *
+ * Prepare the next octet of a DELTA reply.
+ *
+ * The request is REQUEST_DELTA, the octet counter of the host and the
+ * maximum number of data octets it will clock out. The reply carries the
+ * received octets the host has not seen yet, oldest first. The first two
+ * octets are shared with the ordinary message, so the rest is computed
+ * one octet ahead, while the current one is shifted out.
+ *
+ */
+
+static void spi_delta_step(uint8_t rx) {
+ uint8_t pos = spi_counter + 2; // reply octet to prepare
+ uint8_t next = 0xFE;
+ uint8_t n;
+
+ if (spi_counter == 0) {
+  spi_delta.crc = _crc_ccitt_update(0xffff, spi_tx_message.rr_code);
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_tx_message.rr_id);
+  spi_delta.index = spi_tx_message.x10_data.tail / 8;
+  spi_delta.count = 0;
+  spi_delta.next = spi_tx_message.rx_seq & 0xFF;
+  return;
+ }
+
+ // The octet just loaded to USIDR is covered by CRC
+ if (pos <= DELTA_HEADER + spi_delta.count) {
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_delta.next);
+ }
+
+ switch (spi_counter) {
+  case 1:
+   // rx is the octet counter of the host
+   n = (spi_tx_message.rx_seq >> 3) - rx;
+   if (n > DELTA_MAX_OCTETS) {
+    n = DELTA_MAX_OCTETS;
+   }
+   spi_delta.count = n;
+   spi_delta.index = (spi_delta.index + X10_BITSTREAM_OCTETS - n)
+    % X10_BITSTREAM_OCTETS;
+   next = spi_tx_message.rx_seq >> 8;
+   break;
+  case 2:
+   // rx is the maximum number of data octets
+   if (spi_delta.count > rx) {
+    spi_delta.count = rx;
+   }
+   next = spi_delta.count;
+   break;
+  default:
+   if (pos < DELTA_HEADER + spi_delta.count) {
+    next = spi_tx_message.x10_data.data[spi_delta.index];
+    if (++spi_delta.index == X10_BITSTREAM_OCTETS) {
+     spi_delta.index = 0;
+    }
+   } else if (pos == DELTA_HEADER + spi_delta.count) {
+    next = spi_delta.crc & 0xFF;
+   } else if (pos == DELTA_HEADER + spi_delta.count + 1) {
+    next = spi_delta.crc >> 8;
+   }
+ }
+ spi_delta.next = next;
+}
+
+#ifdef X10_DECODE
+/*
+ *
+ * The request is REQUEST_COMMANDS, the record counter of the host and
+ * the maximum number of records it will clock out. The reply carries the
+ * records the host has not seen yet, oldest first, or the newest
+ * X10_CMD_REPLY of them. It is computed one octet ahead like DELTA;
+ * spi_delta.next holds the record counter up to the second octet, index
+ * the first record and count the record octets.
+ *
+ */
+
+static void spi_cmds_step(uint8_t rx) {
+ uint8_t pos = spi_counter + 2; // reply octet to prepare
+ uint8_t next = 0xFE;
+ uint8_t n;
+
+ if (spi_counter == 0) {
+  spi_delta.crc = _crc_ccitt_update(0xffff, spi_tx_message.rr_code);
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_tx_message.rr_id);
+  // Records may be published during the transaction
+  spi_delta.count = 0;
+  spi_delta.next = x10_cmd_seq;
+  return;
+ }
+
+ if (pos <= CMD_HEADER + spi_delta.count) {
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_delta.next);
+ }
+
+ switch (spi_counter) {
+  case 1:
+   // rx is the record counter of the host
+   n = spi_delta.next - rx;
+   if (n > X10_CMD_REPLY) {
+    n = X10_CMD_REPLY;
+   }
+   spi_delta.count = n;
+   spi_delta.index = spi_delta.next - n;
+   next = spi_delta.index;
+   break;
+  case 2:
+   // rx is the maximum number of records
+   if (spi_delta.count > rx) {
+    spi_delta.count = rx;
+   }
+   next = spi_delta.count;
+   spi_delta.count *= sizeof(x10_cmd_record_t);
+   break;
+  default:
+   n = pos - CMD_HEADER;
+   if (n < spi_delta.count) {
+    next = ((uint8_t*)&x10_cmds[(spi_delta.index + n / 4)
+     & (X10_CMD_SLOTS-1)])[n & 3];
+   } else if (n == spi_delta.count) {
+    next = spi_delta.crc & 0xFF;
+   } else if (n == spi_delta.count + 1) {
+    next = spi_delta.crc >> 8;
+   }
+ }
+ spi_delta.next = next;
+}
+#endif
+
+/*
+ *
+ * The request is REQUEST_QUEUE and the maximum number of entries the
+ * host will clock out. The reply lists the queued SEND commands, the one
+ * in transmission first. It is computed one octet ahead like DELTA;
+ * spi_delta.index holds the slot, TX_SLOTS if a bitstream leaves no
+ * room for commands, and count the entries, then the entry octets. A listed slot is only rewritten if
+ * its command completes and another one is appended during the reply,
+ * so the host checks the ids against its own order.
+ *
+ */
+
+static void spi_queue_step(uint8_t rx) {
+ uint8_t pos = spi_counter + 2; // reply octet to prepare
+ uint8_t next = 0xFE;
+ uint8_t n;
+
+ if (spi_counter == 0) {
+  spi_delta.crc = _crc_ccitt_update(0xffff, spi_tx_message.rr_code);
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_tx_message.rr_id);
+  // Commands may complete during the transaction. A bitstream leaves
+  // the queue empty, so nothing is listed from the index.
+  spi_delta.index = tx_fifo.raw ? TX_SLOTS : tx_fifo.head;
+  spi_delta.count = tx_fifo.count;
+  spi_delta.next = TX_SLOTS;
+  return;
+ }
+
+ if (pos <= QUEUE_HEADER + spi_delta.count) {
+  spi_delta.crc = _crc_ccitt_update(spi_delta.crc, spi_delta.next);
+ }
+
+ switch (spi_counter) {
+  case 1:
+   // Free slots
+   next = (spi_delta.index == TX_SLOTS) ? 0 : TX_SLOTS - spi_delta.count;
+   break;
+  case 2:
+   // rx is the maximum number of entries
+   if (spi_delta.count > rx) {
+    spi_delta.count = rx;
+   }
+   next = spi_delta.count;
+   spi_delta.count *= 2;
+   break;
+  default:
+   n = pos - QUEUE_HEADER;
+   if (n < spi_delta.count) {
+    if (n & 1) {
+     next = (n == 1) ? RESPONSE_INPROGRESS : RESPONSE_SEEN;
+    } else {
+     next = tx.send.slot[spi_delta.index].rr_id;
+     if (++spi_delta.index == TX_SLOTS) {
+      spi_delta.index = 0;
+     }
+    }
+   } else if (n == spi_delta.count) {
+    next = spi_delta.crc & 0xFF;
+   } else if (n == spi_delta.count + 1) {
+    next = spi_delta.crc >> 8;
+   }
+ }
+ spi_delta.next = next;
+}
+
 /*
  *
  * This ISR is called when a byte is received/transmitted
@@ -132,14 +476,40 @@ ISR(USI_OVF_vect) {
 
   // tx for index 1..sizeof(spi_message_t)-1
   // and only if tx_enabled is set
- USIDR = (spi_status.tx_enabled && (spi_counter < sizeof(spi_message_t)-1)) ? 
+ USIDR = spi_status.delta ? spi_delta.next :
+  (spi_status.tx_enabled && (spi_counter < sizeof(spi_message_t)-1)) ? 
   ((uint8_t*)&spi_tx_message)[spi_counter+1] : 0xFE;
  
  // End of time-critical section
 
- // Do not overwrite previous request if the new request is POLL
+ // Do not overwrite previous request if the new request is POLL, DELTA,
+ // QUEUE or COMMANDS
  if (spi_counter == 0) {
-  spi_status.rx_body = (tmp_rx == REQUEST_POLL) ? 0 : 1;
+  spi_status.rx_body = (tmp_rx == REQUEST_POLL || tmp_rx == REQUEST_DELTA
+   || tmp_rx == REQUEST_QUEUE) ? 0 : 1;
+  spi_status.queue = (tmp_rx == REQUEST_QUEUE);
+  spi_status.delta = (tmp_rx == REQUEST_DELTA || spi_status.queue)
+   && spi_status.tx_enabled;
+#ifdef X10_DECODE
+  spi_status.commands = (tmp_rx == REQUEST_COMMANDS);
+  if (spi_status.commands) {
+   spi_status.rx_body = 0;
+   spi_status.delta = spi_status.tx_enabled;
+  }
+#endif
+ }
+
+ if (spi_status.delta) {
+#ifdef X10_DECODE
+  if (spi_status.commands) {
+   spi_cmds_step(tmp_rx);
+  } else
+#endif
+  if (spi_status.queue) {
+   spi_queue_step(tmp_rx);
+  } else {
+   spi_delta_step(tmp_rx);
+  }
  }
     
  if (spi_counter<sizeof(spi_message_t)) {
@@ -165,7 +535,7 @@ ISR(INT0_vect) {
  TIMSK |= _BV(OCIE1A);
  TIFR = _BV(OCF1A);
  // Transmit
- if (x10_tx_counter) {
+ if (x10_counter.tx) {
   if (x10_tx & 0x80) {
    PORT_X10 |= _BV(X10_OUT);
    OCR1B = TCNT1 + T1_TICKS(X10_TRANSMIT_LENGTH);
@@ -173,7 +543,7 @@ ISR(INT0_vect) {
    TIFR = _BV(OCF1B);
   } 
   x10_tx <<= 1;
-  --x10_tx_counter;
+  --x10_counter.tx;
  }
 }
 
@@ -201,57 +571,14 @@ ISR(TIMER1_CMPB_vect) {
 ISR(TIMER1_CMPA_vect) {
  
  x10_rx = (x10_rx << 1) + ( bit_is_clear(PIN_X10, X10_IN) ? 1 : 0 );
- x10_rx_counter++;
- /*
- x10_tmp <<= 1;
- if (bit_is_clear(PIN_X10, X10_IN)) {
-  x10_tmp += 1;
- }
- switch (x10_state) {
-  case X10_STATE_IDLE:
-   if ((x10_tmp & 0b1111) == 0b1110) {
-    x10_state = X10_STATE_COMMAND;
-   }
-   break;
-  case X10_STATE_COMMAND:
-  case X10_STATE_EXTENDED:
-   x10_bits++;
-   if (!(x10_bits&1)) {
-    x10_rx <<= 1;
-    switch (x10_tmp&0b11) {
-	 case 0b10:
-	  x10_rx += 1;
-	 case 0b01:
-	  break;
-	 default:
-	  // Houston, we have a problem
-	  x10_state = X10_STATE_IDLE;
-	  x10_bits = 0;
-	  x10_rx = 0;
-	}
-   }
-   if (x10_bits == 18) {
-    switch (x10_rx & 0b11111) {
-	 case 0b01111: // Extended code 1
-//	 case 0b10101: // Extended code 3
-//	 case 0b11001: // Extended code 2
-	  x10_state = X10_STATE_EXTENDED;
-	  break;
-	 default:
-	  x10_state = X10_STATE_RECEIVED;
-	}
-   } else if (x10_bits == 58) {
-    x10_state = X10_STATE_RECEIVED;
-   }
- }
- */
+ x10_counter.rx++;
  
  // One-shot interrupt
  TIMSK &= ~_BV(OCIE1A);
  
 }
 
-inline void spi_enable_rx(void) {
+static inline void spi_enable_rx(void) {
  uint8_t tmp_sreg = SREG;
  
  cli();
@@ -260,7 +587,7 @@ inline void spi_enable_rx(void) {
  SREG = tmp_sreg;
 }
 
-inline void spi_disable_rx(void) {
+static inline void spi_disable_rx(void) {
  uint8_t tmp_sreg = SREG;
  
  cli();
@@ -282,20 +609,25 @@ static void spi_init(void) {
 }
 
 /*
- * Reverse bit order in the word.
+ * Reverse bit order in the word, a nibble at a time.
  */
 
+static const uint8_t nibble_reverse[16] PROGMEM = {
+ 0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+ 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+};
+
 static uint16_t u16_reverse(uint16_t word)
 {
-    uint16_t tmp;
-    uint8_t i;
-    for (i=16; i--;) {
-        tmp <<= 1;
-        if (word & 1)
-            tmp |= 1;
-        word >>= 1;
-    }
-    return tmp;
+ uint16_t rev = 0;
+ uint8_t i;
+
+ // No helper for octets, it would be one more call deep in the stack
+ for (i = 0; i < 4; i++) {
+  rev = (rev << 4) | pgm_read_byte(&nibble_reverse[word & 0x0F]);
+  word >>= 4;
+ }
+ return rev;
 }
 
 /*
@@ -306,34 +638,90 @@ static uint16_t u16_reverse(uint16_t word)
  * detected with greater probability.
  */
 
-uint16_t spi_crc16(spi_message_t *spi_buffer) {
+uint16_t spi_crc16(const uint8_t *spi_buffer, uint8_t len) {
  uint16_t crc = 0xffff;
  
- for (uint8_t i=0; i<sizeof(spi_message_t)-2; i++) {
-  crc = _crc_ccitt_update(crc, ((uint8_t*)spi_buffer)[i]);
+ for (uint8_t i=0; i<len; i++) {
+  crc = _crc_ccitt_update(crc, spi_buffer[i]);
  }
  return u16_reverse(crc);
 }
 
 /*
- * Enable SPI transmission
+ * Check the request received. SEND requests are shorter than the rest.
  */
 
-static void spi_enable_tx(void) {
- uint8_t tmp_sreg = SREG;
+static uint8_t spi_rx_valid(void) {
+ const uint8_t *msg = (const uint8_t*)&spi_rx_message;
+ uint8_t len = (spi_rx_message.rr_code == REQUEST_SEND) ?
+  SEND_LENGTH-2 : sizeof(spi_message_t)-2;
 
- spi_tx_message.crc16 = spi_crc16( (spi_message_t*)&spi_tx_message );
+ return spi_crc16(msg, len) == (msg[len] | (msg[len+1] << 8));
+}
 
- cli();
- spi_status.tx_enabled = 1;
- SREG = tmp_sreg;
+/*
+ * Checksum spi_tx_message as it will be after next is applied.
+ */
+
+static uint16_t spi_tx_next_crc(spi_tx_next_t next, uint8_t slot) {
+ uint16_t crc = 0xffff;
+ uint16_t seq = spi_tx_message.rx_seq;
+ uint8_t tail = spi_tx_message.x10_data.tail;
+ uint8_t i;
+
+ crc = _crc_ccitt_update(crc, next.rr_code);
+ crc = _crc_ccitt_update(crc, next.rr_id);
+ for (i=0; i<X10_BITSTREAM_OCTETS; i++) {
+  crc = _crc_ccitt_update(crc, (next.has_octet && i == slot) ?
+   next.octet : spi_tx_message.x10_data.data[i]);
+ }
+ if (next.has_octet) {
+  tail = (slot == X10_BITSTREAM_OCTETS-1) ? 0 : (slot+1) * 8;
+  seq += 8;
+ }
+ crc = _crc_ccitt_update(crc, tail);
+ crc = _crc_ccitt_update(crc, seq & 0xFF);
+ crc = _crc_ccitt_update(crc, seq >> 8);
+ return u16_reverse(crc);
 }
 
-static void spi_disable_tx(void) {
+/*
+ * Put next in and enable SPI transmission. The CRC is computed first,
+ * with the interrupts on. While the host is clocking a message out, it
+ * must not change, so this waits for the end of the transaction: about
+ * 2 ms at the default SPI speed, while an X10 bit takes 8.3 ms and the
+ * X10 interrupts go on.
+ */
+
+static void spi_tx_commit(spi_tx_next_t next) {
  uint8_t tmp_sreg = SREG;
- 
- cli();
- spi_status.tx_enabled = 0;
+ uint8_t slot = spi_tx_message.x10_data.tail / 8;
+ uint16_t crc = spi_tx_next_crc(next, slot);
+
+ // The host may select us and wait before clocking, while we process
+ // its previous message. Then the first octet preloaded by spi_enable()
+ // is refreshed, unless it is being shifted out already.
+ while (1) {
+  cli();
+  if (!spi_status.running || (spi_counter == 0 && !(USISR & 0x0F))) {
+   break;
+  }
+  SREG = tmp_sreg;
+ }
+ spi_tx_message.rr_code = next.rr_code;
+ spi_tx_message.rr_id = next.rr_id;
+ if (next.has_octet) {
+  spi_tx_message.x10_data.data[slot] = next.octet;
+  // DELTA replies read these in SPI interrupt, keep them consistent
+  spi_tx_message.x10_data.tail =
+   (slot == X10_BITSTREAM_OCTETS-1) ? 0 : (slot+1) * 8;
+  spi_tx_message.rx_seq += 8;
+ }
+ spi_tx_message.crc16 = crc;
+ spi_status.tx_enabled = 1;
+ if (spi_status.running) {
+  USIDR = ((uint8_t*)&spi_tx_message)[0];
+ }
  SREG = tmp_sreg;
 }
 
@@ -345,120 +733,424 @@ static void x10_init(void) {
  TCCR1B |= _BV(CS12) | _BV(CS11) | _BV(CS10); // prescaler at 64
 }
 
-int main(void) {
- uint8_t rx_x10_index = 0;
- struct _x10_tx_state {
-  uint8_t has_bitstream : 1;
-  uint8_t has_postponed_rq : 1;
-  uint8_t bitstream_index : 5;
- } x10_tx_state;
- 
+/*
+ * Bit of the SEND frame at pos: start code, house code, unit or function
+ * code, and for an extended code the unit, data and command octets.
+ * Every data bit is sent as a pair, 1 as 10 and 0 as 01.
+ */
+
+static uint8_t x10_send_frame_bit(uint8_t pos) {
+ x10_send_t *cmd = &tx.send.slot[tx_fifo.head].cmd;
+ uint8_t p, d;
+
+ if (pos < 4) {
+  return (0b1110 >> (3 - pos)) & 1;
+ }
+ pos -= 4;
+ p = pos / 2;
+ if (p < 4 || (p < 8 && tx.send.phase == SEND_ADDRESS)) {
+  d = cmd->code >> (7 - p);
+ } else if (p < 8) {
+  d = cmd->function >> (11 - p);
+ } else if (p == 8) {
+  d = (tx.send.phase == SEND_FUNCTION);
+ } else if (p < 13) {
+  d = cmd->code >> (12 - p);
+ } else if (p < 21) {
+  d = cmd->x_byte_1 >> (20 - p);
+ } else {
+  d = cmd->x_byte_2 >> (28 - p);
+ }
+ return (d ^ pos) & 1;
+}
+
+/*
+ * Next bit of the SEND command: the address frames and a pause, then
+ * the function frames and a pause, like the host builds them.
+ * Returns: the bit, or 2 when the command is over
+ */
+
+static uint8_t x10_send_bit(void) {
+ struct _x10_send_state *s = &tx.send;
+ x10_send_t *cmd = &s->slot[tx_fifo.head].cmd;
+ uint8_t length;
+
+ while (1) {
+  switch (s->phase) {
+   case SEND_ADDRESS:
+   case SEND_FUNCTION:
+    length = (s->phase == SEND_FUNCTION
+     && (cmd->function >> 4) == X10_EXTENDED_CODE) ? 22+40 : 22;
+    if (s->repeats) {
+     if (s->pos < length) {
+      return x10_send_frame_bit(s->pos++);
+     }
+     s->pos = 0;
+     s->repeats--;
+     continue;
+    }
+    s->phase++;
+    // No pause without frames, nor after sticky ones
+    if ((s->phase == SEND_ADDRESS_GAP && !cmd->addr_rpt)
+     || (s->phase == SEND_FUNCTION_GAP
+     && (!cmd->func_rpt || (cmd->function & SEND_STICKY)))) {
+     s->phase++;
+    }
+    break;
+   case SEND_ADDRESS_GAP:
+   case SEND_FUNCTION_GAP:
+    if (s->pos < 6) {
+     s->pos++;
+     return 0;
+    }
+    s->phase++;
+    break;
+   default:
+    return 2;
+  }
+  s->pos = 0;
+  s->repeats = cmd->func_rpt;
+ }
+}
+
+/*
+ * Start expanding the command in the head slot.
+ */
+
+static void x10_send_start(void) {
+ tx.send.phase = SEND_ADDRESS;
+ tx.send.repeats = tx.send.slot[tx_fifo.head].cmd.addr_rpt;
+ tx.send.pos = 0;
+}
+
+/*
+ * Put the SEND request received to the tail of the queue.
+ */
+
+static void x10_send_append(void) {
+ uint8_t i = tx_fifo.head + tx_fifo.count;
+ struct _x10_tx_slot *slot = &tx.send.slot[(i < TX_SLOTS) ? i : i - TX_SLOTS];
+
+ slot->rr_id = spi_rx_message.rr_id;
+ slot->cmd = *(x10_send_t*)spi_rx_message.x10_data.data;
+ cli(); // QUEUE replies take a snapshot of tx_fifo
+ tx_fifo.count++;
+ sei();
+}
+
+/*
+ * The head command is over, go on with the next one.
+ */
+
+static void x10_send_next(void) {
+ cli();
+ tx_fifo.head = (tx_fifo.head == TX_SLOTS-1) ? 0 : tx_fifo.head + 1;
+ tx_fifo.count--;
+ sei();
+ x10_send_start();
+}
+
+/*
+ * Expand the next bits of the SEND command.
+ * Returns: number of bits put to *octet, MSB first; 0 when it is over
+ */
+
+static uint8_t x10_send_octet(uint8_t *octet) {
+ uint8_t n, bit;
+
+ *octet = 0;
+ for (n = 0; n < 8; n++) {
+  bit = x10_send_bit();
+  if (bit > 1) {
+   break;
+  }
+  *octet |= bit << (7 - n);
+ }
+ return n;
+}
+
+#ifdef X10_DECODE
+/*
+ * Publish the last frame, no more repetitions of it will come.
+ */
+
+static void x10_cmd_close(void) {
+ if (x10_dec.open) {
+  x10_cmd_seq++;
+  x10_dec.open = 0;
+ }
+}
+
+/*
+ * A whole frame is received. It is either a repetition of the last frame,
+ * or a new record.
+ */
+
+static void x10_cmd_frame(void) {
+ x10_cmd_record_t rec;
+ x10_cmd_record_t *slot = &x10_cmds[x10_cmd_seq & (X10_CMD_SLOTS-1)];
+
+ if (x10_dec.count > 18) {
+  // house, function, flag, unit, data, command
+  rec.code = ((x10_dec.code >> 21) & 0xF0) | ((x10_dec.code >> 16) & 0x0F);
+  rec.flags = CMD_FUNCTION | CMD_EXTENDED;
+  rec.x_byte_1 = x10_dec.code >> 8;
+  rec.x_byte_2 = x10_dec.code;
+ } else {
+  // house, unit or function, flag
+  rec.code = x10_dec.code >> 1;
+  rec.flags = (x10_dec.code & 1) ? CMD_FUNCTION : 0;
+  rec.x_byte_1 = 0;
+  rec.x_byte_2 = 0;
+ }
+
+ if (x10_dec.open && slot->code == rec.code
+  && (slot->flags & ~CMD_REPEATS) == rec.flags
+  && slot->x_byte_1 == rec.x_byte_1 && slot->x_byte_2 == rec.x_byte_2) {
+  if ((slot->flags & CMD_REPEATS) != CMD_REPEATS) {
+   slot->flags++;
+  }
+  return;
+ }
+
+ x10_cmd_close();
+ rec.flags |= 1;
+ x10_cmds[x10_cmd_seq & (X10_CMD_SLOTS-1)] = rec;
+ x10_dec.open = 1;
+}
+
+/*
+ * Decode the received bits, the same way the host does.
+ */
+
+static void x10_decode_bit(uint8_t bit) {
+ x10_dec.shift = (x10_dec.shift << 1) | bit;
+ if (x10_dec.count < 255) {
+  x10_dec.count++;
+ }
+
+ switch (x10_dec.state) {
+  case DEC_IDLE:
+   // A repetition follows the frame immediately
+   if (x10_dec.count == 5) {
+    x10_cmd_close();
+   }
+   if ((x10_dec.shift & 0x0F) == 0x0E) {
+    x10_dec.state = DEC_FRAME;
+    x10_dec.count = 0;
+    x10_dec.code = 0;
+   }
+   break;
+  case DEC_FRAME:
+   if (x10_dec.count & 1) {
+    break;
+   }
+   switch (x10_dec.shift & 0b11) {
+    case 0b10:
+     x10_dec.code = (x10_dec.code << 1) | 1;
+     break;
+    case 0b01:
+     x10_dec.code <<= 1;
+     break;
+    default:
+     // Houston, we have a problem
+     x10_dec.state = DEC_RECOVER;
+     x10_cmd_close();
+     return;
+   }
+   if ((x10_dec.count == 18
+    && (x10_dec.code & 0x1F) != ((X10_EXTENDED_CODE << 1) | 1))
+    || x10_dec.count == 58) {
+    x10_cmd_frame();
+    x10_dec.state = DEC_IDLE;
+    x10_dec.count = 0;
+    x10_dec.shift = 0;
+   }
+   break;
+  default:
+   // Wait for the line to be quiet
+   if ((x10_dec.shift & 0x3F) == 0) {
+    x10_dec.state = DEC_IDLE;
+   }
+ }
+}
+
+static void x10_decode_octet(uint8_t octet) {
+ uint8_t i;
+
+ for (i = 8; i--;) {
+  x10_decode_bit((octet >> i) & 1);
+ }
+}
+#endif
+
+// A bitstream or SEND commands are being transmitted
+static inline uint8_t x10_tx_busy(void) {
+ return tx_fifo.raw || tx_fifo.count;
+}
+
+static void main_init(void) {
  // Pullup all unused pins at PORTA.
  DDRA = 0x00;
  PORTA = 0xff;
 
  spi_init();
  x10_init();
- 
- x10_tx_state.has_bitstream = 0;
- 
+
  sei();
- spi_enable_tx();
- while (1) {
-  
-  // Just received 8 bits of X10 stream
-  if (x10_rx_counter >= 8) {
-   // spi_disable_tx(); // we will modify spi_tx_message.
-   cli(); // delay x10 interrupts, just in case...
-   spi_tx_message.x10_data.data[rx_x10_index++] = x10_rx;
-   x10_rx_counter = 0;
-   sei();
-   // Wraparound
-   if (rx_x10_index == X10_BITSTREAM_OCTETS) {
-    rx_x10_index = 0;
-   }
-   spi_tx_message.x10_data.tail = rx_x10_index * 8;
-  }
+ // The reply is empty, with its CRC
+ spi_tx_commit((spi_tx_next_t){ 0 });
+}
+
+/*
+ * A pass of the main loop. The firmware simulator of the host calls it
+ * in between the interrupts.
+ */
 
-  // We have data to transmit and previous X10 chunk is sent
-  if (x10_tx_state.has_bitstream && !x10_tx_counter) {
+static inline void main_loop(void) {
+ uint8_t tx_octet, tx_bits, i;
+ spi_tx_next_t next = {
+  .rr_code = spi_tx_message.rr_code,
+  .rr_id = spi_tx_message.rr_id,
+ };
 
-   if (tx_bitstream.tail == 0) {
-    // This transmission is over
-    spi_disable_tx();
-	if ( !x10_tx_state.has_postponed_rq ) {
-	 spi_tx_message.rr_code = RESPONSE_COMPLETE;
-	}
-	x10_tx_state.has_bitstream = 0;
+ // Just received 8 bits of X10 stream
+ if (x10_counter.rx >= 8) {
+  cli(); // delay x10 interrupts, just in case...
+  next.octet = x10_rx;
+  x10_counter.rx = 0;
+  sei();
+  next.has_octet = 1;
+  next.dirty = 1;
+#ifdef X10_DECODE
+  x10_decode_octet(next.octet);
+#endif
+ }
+
+ // We have data to transmit and previous X10 chunk is sent
+ if (x10_tx_busy() && !x10_counter.tx) {
+
+  if (tx_fifo.raw) {
+   tx_octet = tx.bits.data[0];
+   // the last octet may be incomplete
+   tx_bits = (tx.bits.tail < 8) ? tx.bits.tail : 8;
+   tx.bits.tail -= tx_bits;
+   // The rest moves down, there is no RAM for an index
+   for (i = 0; i < X10_BITSTREAM_OCTETS-1; i++) {
+    tx.bits.data[i] = tx.bits.data[i+1];
    }
-   else {
-    // The transmission is not finished yet.
-    cli(); // delay X10 interrupts
-	x10_tx = tx_bitstream.data[x10_tx_state.bitstream_index++];
-	if (tx_bitstream.tail < 8) {
-	 // this is last and incomplete octet
-	 x10_tx_counter = tx_bitstream.tail;
-	 tx_bitstream.tail = 0;
-	}
-	else {
-	 // one more complete octet to send
-	 x10_tx_counter = 8;
-	 tx_bitstream.tail -= 8;
+  }
+  else {
+   tx_bits = x10_send_octet(&tx_octet);
+   if (tx_bits == 0 && tx_fifo.count > 1) {
+    // The next queued command follows without a gap
+    x10_send_next();
+    tx_bits = x10_send_octet(&tx_octet);
+    if (tx.send.slot[tx_fifo.head].rr_id == next.rr_id
+     && !tx_fifo.postponed) {
+     next.rr_code = RESPONSE_INPROGRESS;
+     next.dirty = 1;
+    }
+   }
+  }
+
+  if (tx_bits == 0) {
+   // This transmission is over
+	if ( !tx_fifo.postponed ) {
+	 next.rr_code = RESPONSE_COMPLETE;
+	 next.dirty = 1;
 	}
+	cli();
+	tx_fifo.count = 0;
+	tx_fifo.raw = 0;
 	sei();
-   }
   }
+  else {
+   // The transmission is not finished yet.
+   cli(); // delay X10 interrupts
+	x10_tx = tx_octet;
+	x10_counter.tx = tx_bits;
+	sei();
+  }
+ }
 
-  // A new SPI message has arrived
-  if (spi_status.rx_done ||
-   // or there was a postponed message, and it's time to look at it.
-   ( x10_tx_state.has_postponed_rq && !x10_tx_state.has_bitstream )) {
-   // From this point, there is need for integrity protection against SPI
-   spi_disable_rx();
-   // If CRC is correct
-   if (spi_crc16((spi_message_t*)&spi_rx_message) == spi_rx_message.crc16
-    // and it is a new request
-    && (( spi_rx_message.rr_id != spi_tx_message.rr_id )
+ // A new SPI message has arrived
+ if (spi_status.rx_done ||
+  // or there was a postponed message, and it's time to look at it.
+  ( tx_fifo.postponed && !x10_tx_busy() )) {
+  // From this point, there is need for integrity protection against SPI
+  spi_disable_rx();
+  // If CRC is correct
+  if (spi_rx_valid()
+   // and it is a new request
+   && (( spi_rx_message.rr_id != next.rr_id )
 	// or there was a postponed request
-	|| (x10_tx_state.has_postponed_rq))) {
-    // In both cases, postponed request cannot stay in the same state.
-    x10_tx_state.has_postponed_rq = 0;
-	// We will change tx_message, so it can become invalid.
-	//spi_disable_tx();
+	|| (tx_fifo.postponed))) {
+   // In both cases, postponed request cannot stay in the same state.
+   tx_fifo.postponed = 0;
+	next.dirty = 1;
 	switch (spi_rx_message.rr_code) {
-     case REQUEST_CANCEL:
+    case REQUEST_CANCEL:
 	  // Cancel current transmission, if any. Done.
-	  x10_tx_state.has_bitstream = 0;
-	  spi_tx_message.rr_id = spi_rx_message.rr_id;
-	  spi_tx_message.rr_code = RESPONSE_COMPLETE;
+	  cli();
+	  tx_fifo.count = 0;
+	  tx_fifo.raw = 0;
+	  sei();
+	  next.rr_id = spi_rx_message.rr_id;
+	  next.rr_code = RESPONSE_COMPLETE;
 	  break;
 	 case REQUEST_TRANSMIT:
+	 case REQUEST_SEND:
 	  // It's a valid request, need to ack it.
-      spi_tx_message.rr_id = spi_rx_message.rr_id;
-	  if (!x10_tx_state.has_bitstream) {
-	   // Init bitstream sender
-       tx_bitstream = spi_rx_message.x10_data;
-	   x10_tx_state.has_bitstream = 1;
-	   x10_tx_state.bitstream_index = 0;
-       // Now we are transmitting
-	   spi_tx_message.rr_code = RESPONSE_INPROGRESS;
+     next.rr_id = spi_rx_message.rr_id;
+	  if (!x10_tx_busy()) {
+	   if (spi_rx_message.rr_code == REQUEST_SEND) {
+	    // Init command expander
+	    x10_send_append();
+	    x10_send_start();
+	   }
+	   else {
+	    // Init bitstream sender
+	    cli();
+	    tx_fifo.raw = 1;
+	    sei();
+	    tx.bits = spi_rx_message.x10_data;
+	   }
+      // Now we are transmitting
+	   next.rr_code = RESPONSE_INPROGRESS;
+	  }
+	  else if (spi_rx_message.rr_code == REQUEST_SEND && !tx_fifo.raw
+	   && tx_fifo.count < TX_SLOTS) {
+	   // Commands are queued behind the one in transmission
+	   x10_send_append();
+	   next.rr_code = RESPONSE_SEEN;
 	  }
 	  else {
 	   // the request should be chained, where possible
-       x10_tx_state.has_postponed_rq = 1; 
-       // This request can still be overwritten by host
-	   spi_tx_message.rr_code = RESPONSE_SEEN;   
+      tx_fifo.postponed = 1; 
+      // This request can still be overwritten by host
+	   next.rr_code = RESPONSE_SEEN;   
 	  }
 	  break;
 	  // Default is to ignore the request
 	}
-   } else {
-    x10_tx_state.has_postponed_rq = 0;
-   }
-   // Wait fot a new SPI message
-   spi_enable_rx();
+  } else {
+   tx_fifo.postponed = 0;
   }
+  // Wait fot a new SPI message
+  spi_enable_rx();
+ }
 
-  spi_enable_tx();
+ if (next.dirty) {
+  spi_tx_commit(next);
+ }
+}
+
+#ifndef X10_SIM
+int main(void) {
+ main_init();
+ while (1) {
+  main_loop();
  }
 }
+#endif
@@ -3,31 +3,73 @@
  *
  * CM11 emulator code.
  *
+ * The emulator is driven by events: input from the PC, and timers for
+ * the receive polls, the transmit queue and the UART idle timeout. A
+ * command from the PC is put to the transmit queue and answered with
+ * 0x55 once the queue reports it done, so the PC and the powerline are
+ * served while it is transmitted.
+ *
+ * Commands received from the powerline are serialized at once into
+ * upload buffers, as many as fit into one, and the buffers wait in a
+ * ring for the PC to take them one per 0x5A poll.
+ *
+ * Either the PC is on stdin and stdout, or there are several of them,
+ * each on a pseudo-terminal of its own. Every client has its own state
+ * and buffers, and every one gets all the commands received; they share
+ * the transmit queue and the receiver.
+ *
  * Copyright (c) 2013 pavel@levshin.spb.ru
  *
  */
 
+#define _GNU_SOURCE	// pseudo-terminals
 
-#include <time.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "x10-spi.h"
 #include "cm11.h"
+#include "txqueue.h"
 
 #define CM11_WBUF_OCTETS 10
-
-static uint8_t cm11_cbuf[CM11_WBUF_OCTETS];
-static int cm11_has_cbuf = 0;
-static int cm11_fresh_rbuf = 0;
-static uint8_t cm11_rbuf[100];
-static uint8_t cm11_wbuf[20];
-static int cm11_wbuf_bytes, cm11_rbuf_bytes;
+#define CM11_IDLE_MS 1000	// UART idle timeout
+#define CM11_UPLOADS 8		// upload buffers waiting for the PC
 
 enum cm11_state {
 	cm11_state_ready,
 	cm11_state_tx_ack,
 	cm11_state_rx_poll,
+	cm11_state_tx_exec,
+	cm11_state_tx_wait,	// the queue is full, push again
+};
+
+struct cm11_client {
+	int in, out;		// the PC
+	int pty_slave;		// kept open, so the PC may come and go
+	int idle_timer;
+	enum cm11_state state;
+	struct x10_command a_cmd;	// command parsed
+	struct x10_command cmd;		// command being transmitted
+	uint8_t uploads[CM11_UPLOADS][CM11_WBUF_OCTETS];
+	int upload_head, upload_count;
+	int upload_full;	// commands are being dropped
+	long upload_overflows;	// times the ring has filled up
+	long upload_drops;	// commands dropped then
+	// Input from the PC, a ring consumed as the frames are complete
+	uint8_t rbuf[128];
+	int rbuf_head, rbuf_bytes;
+	uint8_t wbuf[20];
+	int wbuf_bytes;
 };
 
+static struct cm11_client cm11_clients[CM11_MAX_CLIENTS];
+static int cm11_nclients;
+static struct x10_tx_queue cm11_txq;
+static int cm11_rx_timer, cm11_txq_timer;
+static int cm11_txq_armed;
+
 static int cm11_command_parse(uint8_t *buf, int bytes, struct x10_command *p_cmd)
 {
 	uint8_t hdr;
@@ -39,10 +81,10 @@ static int cm11_command_parse(uint8_t *buf, int bytes, struct x10_command *p_cmd
 
 	memset(p_cmd, 0, sizeof(*p_cmd));
 	hdr = *buf;
-	if (bytes < 2)
-		return 0; // too few data in the buffer
 	if ((hdr & 0x04) == 0)
 		return -1; // this cannot be a transfer
+	if (bytes < 2)
+		return 0; // too few data in the buffer
 	dims = (hdr >> 3) & 0x1F;
 	is_function = hdr & 0x02;
 	is_extended = hdr & 0x01;
@@ -69,17 +111,34 @@ static int cm11_command_parse(uint8_t *buf, int bytes, struct x10_command *p_cmd
 	return length;
 }
 
-static void cm11_command_tobuffer(struct x10_command *p_cmd, uint8_t *wbuf)
+/*
+ * Append the command to an upload buffer.
+ * Returns: 0 on success,
+ *			-1 if it does not fit, the buffer is left as it was
+ */
+
+static int cm11_command_tobuffer(struct x10_command *p_cmd, uint8_t *wbuf)
 {
 	int i, j;
 	int dimlevel;
+	int octets = 0;
 
 	i = wbuf[0];
 	if (i == 0)
 		i = 1;
 
-	if (i + 1 > CM11_WBUF_OCTETS - 1)
-		return;
+	if (p_cmd->addr_rpt)
+		octets++;
+	if (p_cmd->func_rpt) {
+		octets++;
+		if (p_cmd->fc == X10_FUNC_DIM || p_cmd->fc == X10_FUNC_BRIGHT)
+			octets++;
+		else if (p_cmd->fc == X10_FUNC_EXTENDEDCODE)
+			octets += 3;
+	}
+	if (i + octets > CM11_WBUF_OCTETS - 1)
+		return -1;
+
 	if (p_cmd->addr_rpt) {
 		wbuf[++i] = (_x10_code[p_cmd->hc] << 4)
 			+ _x10_code[p_cmd->uc];
@@ -91,15 +150,11 @@ static void cm11_command_tobuffer(struct x10_command *p_cmd, uint8_t *wbuf)
 		switch (p_cmd->fc) {
 		case X10_FUNC_DIM:
 		case X10_FUNC_BRIGHT:
-			if (i + 1 > CM11_WBUF_OCTETS - 1)
-				return;
 			// 1 -> 2.5, >=2 -> 13,5*(i-1)
 			dimlevel = (p_cmd->func_rpt - 1) * 11 + 3;
 			wbuf[++i] = (dimlevel < 210) ? dimlevel : 210;
 			break;
 		case X10_FUNC_EXTENDEDCODE:
-			if (i + 3 > CM11_WBUF_OCTETS - 1)
-				return;
 			wbuf[++i] = _x10_code[p_cmd->uc];
 			wbuf[++i] = p_cmd->x_byte_1;
 			wbuf[++i] = p_cmd->x_byte_2;
@@ -111,24 +166,91 @@ static void cm11_command_tobuffer(struct x10_command *p_cmd, uint8_t *wbuf)
 	for (j = 0; j < i + 1; j++)
 		plog(1, "%.2X ", wbuf[j]);
 	plog(1, "]\n");
+	return 0;
+}
+
+static void cm11_client_receive(struct cm11_client *cl,
+	struct x10_command *p_cmd)
+{
+	uint8_t *wbuf;
+
+	// Join the last buffer, unless the PC has it already
+	if (cl->upload_count && cm11_command_tobuffer(p_cmd,
+		cl->uploads[(cl->upload_head + cl->upload_count - 1)
+		% CM11_UPLOADS]) == 0)
+		return;
 
+	if (cl->upload_count == CM11_UPLOADS) {
+		if (!cl->upload_full)
+			cl->upload_overflows++;
+		cl->upload_full = 1;
+		cl->upload_drops++;
+		plog(0, "PC %d is slow to take the commands, %ld dropped\n",
+			cl->in, cl->upload_drops);
+		return;
+	}
+	wbuf = cl->uploads[(cl->upload_head + cl->upload_count++)
+		% CM11_UPLOADS];
+	memset(wbuf, 0, CM11_WBUF_OCTETS);
+	cm11_command_tobuffer(p_cmd, wbuf);
 }
 
-static void cm11_x10_receive(struct x10_command *p_cmd)
+static void cm11_x10_receive(void *data, struct x10_command *p_cmd)
 {
+	int i;
+
 	plog(1, "CM11 have received a command from PLC\n");
-	cm11_command_tobuffer(p_cmd, cm11_cbuf);
-	cm11_has_cbuf = 1;
+	for (i = 0; i < cm11_nclients; i++)
+		cm11_client_receive(&cm11_clients[i], p_cmd);
+}
+
+/*
+ * Hand the first upload buffer to the PC, as it is
+ */
+
+static void cm11_upload(struct cm11_client *cl)
+{
+	uint8_t *wbuf = cl->uploads[cl->upload_head];
+
+	memcpy(cl->wbuf, wbuf, wbuf[0] + 1);
+	cl->wbuf_bytes = wbuf[0] + 1;
+	cl->upload_head = (cl->upload_head + 1) % CM11_UPLOADS;
+	cl->upload_count--;
+	cl->upload_full = 0;
+}
+
+/*
+ * Transmit queue callback
+ */
+
+static void cm11_execute_done(struct cm11_client *cl)
+{
+	cl->wbuf[0] = 0x55;
+	cl->wbuf_bytes = 1;
+	cl->state = cm11_state_ready;
+}
+
+static void cm11_report(void *owner, int ret, int ncmds)
+{
+	struct cm11_client *cl = owner;
+
+	if (!ret)
+		plog(0, "SPI transaction has failed!\n");
+	else
+		plog(1, "SPI transaction has succeeded\n");
+	// The message with the last frame of the command carries it
+	if (ncmds && cl->state == cm11_state_tx_exec)
+		cm11_execute_done(cl);
 }
 
 static void cm11_init(void)
 {
-	feed_bit_callback = &x10_decode_bit;
-	commit_x10_callback = &cm11_x10_receive;
-	memset(cm11_rbuf, 0, sizeof(cm11_rbuf));
-	memset(cm11_cbuf, 0, sizeof(cm11_cbuf));
-	cm11_wbuf_bytes = 0;
-	cm11_rbuf_bytes = 0;
+	feed_octet_callback = &x10_decode_octet;
+	flush_bits_callback = &x10_decode_flush;
+	x10_decode_init(&cm11_x10_receive, NULL);
+	memset(cm11_clients, 0, sizeof(cm11_clients));
+	cm11_nclients = 0;
+	x10_txq_init(&cm11_txq, &cm11_report);
 }
 
 
@@ -143,187 +265,407 @@ static uint8_t cm11_checksum(uint8_t *buf, int bytes)
 	return cs;
 }
 
-static void cm11_execute(int fd, struct x10_command *p_cmd)
+/*
+ * Put the command to the queue. The frames of a dim or bright ramp go
+ * back to back, packed into as few chained messages as fit them (or a
+ * single SEND request). If the commands of the other PCs fill the
+ * queue, the command is pushed again on the next pass.
+ */
+
+static void cm11_push(int fd, struct cm11_client *cl)
 {
-	int ret, i;
-	struct spi_message spi_tx_message, spi_rx_message;
-	int repetitions = 0;
-
-	if (p_cmd->func_rpt > 2) {
-		// This is a special case, likely DIM or BRIGHT
-		plog(1, "Splitting the command to multiple transmissions\n");
-		repetitions = p_cmd->func_rpt;
-		p_cmd->func_rpt = 1;
-		p_cmd->sticky = 1;
-		prepare_x10_transmit(&spi_tx_message, p_cmd);
-		for (i = repetitions; i > 1; --i) {
-			ret = reliable_spi_transfer(fd, &spi_tx_message,
-				&spi_rx_message, SPI_RESPONSE_INPROGRESS);
-			if (!ret)
-				plog(0, "SPI transaction has failed!\n");
-			else
-				plog(1, "SPI transaction has succeeded\n");
-		}
+	int ret;
+
+	cl->state = cm11_state_tx_exec;
+	ret = x10_txq_push(fd, &cm11_txq, &cl->cmd, 1, SPI_RESPONSE_COMPLETE,
+		cl);
+	if (ret > 0) {
+		cl->state = cm11_state_tx_wait;
+	} else if (ret < 0) {
+		plog(0, "Cannot transmit the command\n");
+		cm11_execute_done(cl);
 	}
-	// final transfer
-	p_cmd->sticky = 0;
-	prepare_x10_transmit(&spi_tx_message, p_cmd);
-	ret = reliable_spi_transfer(fd, &spi_tx_message, &spi_rx_message,
-		SPI_RESPONSE_COMPLETE);
-	if (!ret)
-		plog(0, "SPI transaction has failed!\n");
-	else
-		plog(1, "SPI transaction has succeeded\n");
+}
 
+static void cm11_execute(int fd, struct cm11_client *cl)
+{
+	cl->cmd = cl->a_cmd;
+	cm11_push(fd, cl);
 }
 
-static struct timespec timespec_diff(struct timespec start, struct timespec end)
+/*
+ * UART idle timeout: drop a partial exchange with the PC
+ */
+
+static void cm11_idle(struct cm11_client *cl)
 {
-	struct timespec temp;
-	if ((end.tv_nsec-start.tv_nsec)<0) {
-		temp.tv_sec = end.tv_sec-start.tv_sec-1;
-		temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
-	} else {
-		temp.tv_sec = end.tv_sec-start.tv_sec;
-		temp.tv_nsec = end.tv_nsec-start.tv_nsec;
+	if (cl->state == cm11_state_tx_exec || cl->state == cm11_state_tx_wait)
+		return;
+	if (cl->state != cm11_state_ready || cl->rbuf_bytes > 0) {
+		plog(1, "UART idle timeout\n");
+		// Flush the buffer
+		cl->rbuf_bytes = 0;
+		cl->state = cm11_state_ready;
 	}
-	return temp;
 }
 
-static int cm11_state_machine(int fd)
+/*
+ * Copy up to len octets from the start of the input
+ * Returns: number of octets copied
+ */
+
+static int cm11_rx_peek(struct cm11_client *cl, uint8_t *buf, int len)
 {
-	static enum cm11_state state = cm11_state_ready;
-	int parsed_bytes;
-	static struct x10_command a_cmd;
-	static struct timespec cm11_timer, ts_tmp, ts_diff;
+	int i;
 
-	plog(1, "State %d, rbuf %d\n", state, cm11_rbuf_bytes);
+	if (len > cl->rbuf_bytes)
+		len = cl->rbuf_bytes;
+	for (i = 0; i < len; i++)
+		buf[i] = cl->rbuf[(cl->rbuf_head + i) % sizeof(cl->rbuf)];
+	return len;
+}
 
-	if (cm11_fresh_rbuf) {
-		clock_gettime(CLOCK_MONOTONIC, &cm11_timer);
-	} else {
-		clock_gettime(CLOCK_MONOTONIC, &ts_tmp);
-		ts_diff = timespec_diff(cm11_timer, ts_tmp);
-		if (ts_diff.tv_sec >= 1) {
-			if ( state != cm11_state_ready
-				|| cm11_rbuf_bytes > 0 ) {
-				plog(1, "UART idle timeout\n");
-				// Flush the buffer
-				cm11_rbuf_bytes = 0;
-				state = cm11_state_ready;
-			}
-			clock_gettime(CLOCK_MONOTONIC, &cm11_timer);
-		}
+static void cm11_rx_consume(struct cm11_client *cl, int len)
+{
+	cl->rbuf_head = (cl->rbuf_head + len) % sizeof(cl->rbuf);
+	cl->rbuf_bytes -= len;
+}
+
+/*
+ * Length of the messages the PC sends on its own, other than
+ * transmissions. The emulator does not act on them.
+ * Returns: number of octets, 0 if unknown
+ */
+
+static int cm11_pc_message_bytes(uint8_t octet)
+{
+	switch (octet) {
+	case 0x9B:	// set the clock, 6 octets follow
+		return 7;
+	case 0xEB:	// enable ring signal
+	case 0xDB:	// disable ring signal
+		return 1;
+	default:
+		return 0;
 	}
+}
+
+/*
+ * Returns: 1 if the input is to be looked at once more
+ */
+
+static int cm11_state_machine(int fd, struct cm11_client *cl)
+{
+	uint8_t frame[5] = { 0 };
+	int frame_bytes;
+	int parsed_bytes;
+
+	plog(1, "State %d, rbuf %d\n", cl->state, cl->rbuf_bytes);
 
-	switch (state) {
+	switch (cl->state) {
 	case cm11_state_ready:
 		// Try to parse the command
 		// If it is incomlete, wait more
 		parsed_bytes = 0;
-		if (cm11_fresh_rbuf)
-			parsed_bytes = cm11_command_parse(cm11_rbuf, 
-				cm11_rbuf_bytes, &a_cmd);
+		frame_bytes = cm11_rx_peek(cl, frame, sizeof(frame));
+		if (frame_bytes)
+			parsed_bytes = cm11_command_parse(frame, frame_bytes,
+				&cl->a_cmd);
 		if (parsed_bytes > 0) {
 			plog(1, "Just parsed the command\n");
-			log_command(1, &a_cmd);
-			cm11_wbuf[0] = cm11_checksum(cm11_rbuf, cm11_rbuf_bytes);
-			cm11_wbuf_bytes = 1;
-			// flush the buffer
-			cm11_rbuf_bytes = 0;
-			state = cm11_state_tx_ack;
-			break;
+			log_command(1, &cl->a_cmd);
+			cl->wbuf[0] = cm11_checksum(frame, parsed_bytes);
+			cl->wbuf_bytes = 1;
+			// The rest is what the PC has sent after it
+			cm11_rx_consume(cl, parsed_bytes);
+			cl->state = cm11_state_tx_ack;
+			return cl->rbuf_bytes > 0;
 		}
 		if (parsed_bytes < 0) {
-			// flush the buffer, it is broken
-			cm11_rbuf_bytes = 0;
+			// Not a transmission. A message of known length is
+			// skipped whole, so its payload is not taken for
+			// headers; an unknown octet is dropped alone and
+			// the next one is tried as a header.
+			parsed_bytes = cm11_pc_message_bytes(frame[0]);
+			if (parsed_bytes == 0) {
+				plog(1, "Unknown octet %.2X, skipping\n", frame[0]);
+				cm11_rx_consume(cl, 1);
+				return cl->rbuf_bytes > 0;
+			} else if (cl->rbuf_bytes >= parsed_bytes) {
+				cm11_rx_consume(cl, parsed_bytes);
+				return cl->rbuf_bytes > 0;
+			} else {
+				// Wait for the rest
+				break;
+			}
 		}
-		if (cm11_has_cbuf) {
+		if (cl->upload_count) {
 			plog(1, "Going to poll PC\n");
-			cm11_wbuf[0] = 0x5A;
-			cm11_wbuf_bytes = 1;
-			state = cm11_state_rx_poll;
+			cl->wbuf[0] = 0x5A;
+			cl->wbuf_bytes = 1;
+			cl->state = cm11_state_rx_poll;
 			break;
 		}
 		break;
 	case cm11_state_tx_ack:
-		if (cm11_fresh_rbuf) {
-			if (cm11_rbuf[0] == 0) {
+		if (cm11_rx_peek(cl, frame, 1)) {
+			if (frame[0] == 0) {
 				plog(1, "Going to execute the transmission\n");
-				cm11_execute(fd, &a_cmd);
-				cm11_rbuf_bytes = 0;
-				cm11_wbuf[0] = 0x55;
-				cm11_wbuf_bytes = 1;
-				state = cm11_state_ready;
+				cm11_rx_consume(cl, 1);
+				// 0x55 follows when the queue is done with it
+				cm11_execute(fd, cl);
 				break;
 			}
 			// looks like a new transmission
-			state = cm11_state_ready;
+			cl->state = cm11_state_ready;
 			return 1;
 		}
 		break;
 	case cm11_state_rx_poll:
-		if (cm11_fresh_rbuf) {
-			if (cm11_rbuf[0] == 0xC3) {
+		if (cm11_rx_peek(cl, frame, 1)) {
+			if (frame[0] == 0xC3) {
 				plog(1, "Poll answered from PC\n");
-				cm11_rbuf_bytes = 0;
-				memcpy(cm11_wbuf, cm11_cbuf, cm11_cbuf[0] + 1);
-				cm11_wbuf_bytes = cm11_cbuf[0] + 1;
-				memset(cm11_cbuf, 0, sizeof(cm11_cbuf));
-				cm11_has_cbuf = 0;
-				state = cm11_state_ready;
-				break;
+				cm11_rx_consume(cl, 1);
+				cm11_upload(cl);
+				cl->state = cm11_state_ready;
+				return cl->rbuf_bytes > 0;
 			}
 			// looks like a new transmission
-			state = cm11_state_ready;
+			cl->state = cm11_state_ready;
 			return 1;
 		}
 		break;
+	case cm11_state_tx_exec:
+		// The PC waits for 0x55, its input is kept until then
+		break;
+	case cm11_state_tx_wait:
+		cm11_push(fd, cl);
+		break;
 	}
 	return 0;
 }
 
-void cm11(int fd)
+/*
+ * Arm a one-shot timer, ms < 0 disarms it
+ */
+
+static void cm11_timer_set(int timer, long ms)
 {
-	fd_set readset;
-	struct timeval tv;
-	int i;
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (ms >= 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+		// Zero would disarm the timer, while it is due at once
+		if (ms == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(timer, 0, &its, NULL) < 0)
+		pabort("can't set timer");
+}
+
+static int cm11_timer_new(int ep)
+{
+	struct epoll_event ev;
+	int timer;
+
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer < 0)
+		pabort("can't create timer");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, timer, &ev) < 0)
+		pabort("can't watch timer");
+	return timer;
+}
+
+/*
+ * Returns: 1 if the timer has expired, clearing it
+ */
+
+static int cm11_timer_expired(int timer)
+{
+	uint64_t expirations;
+
+	return read(timer, &expirations, sizeof(expirations)) > 0;
+}
+
+static void cm11_write(struct cm11_client *cl)
+{
+	if (cl->wbuf_bytes) {
+		if (write(cl->out, cl->wbuf, cl->wbuf_bytes) != cl->wbuf_bytes)
+			plog(1, "Short write to PC %d\n", cl->in);
+		cl->wbuf_bytes = 0;
+	}
+}
+
+/*
+ * Input from the PC. Returns: 0 when the PC is gone
+ */
+
+static int cm11_read(struct cm11_client *cl)
+{
+	int i, tail, room;
 	int rx;
 
+	if (cl->rbuf_bytes == sizeof(cl->rbuf)) {
+		plog(1, "Input buffer overflow\n");
+		cl->rbuf_bytes = 0;
+	}
+	// Up to the end of the ring, the rest comes with the next event
+	tail = (cl->rbuf_head + cl->rbuf_bytes) % sizeof(cl->rbuf);
+	room = sizeof(cl->rbuf) - cl->rbuf_bytes;
+	if (room > sizeof(cl->rbuf) - tail)
+		room = sizeof(cl->rbuf) - tail;
+	rx = read(cl->in, cl->rbuf + tail, room);
+	if (rx < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+	if (rx < 0)
+		pabort("Error reading from PC");
+	if (rx == 0) {
+		plog(0, "Pipe has been closed by remote\n");
+		return 0;
+	}
+	plog(1, "RX %d bytes from %d, ", rx, cl->in);
+	for (i = tail; i < tail + rx; i++)
+		plog(1, "%.2x ", cl->rbuf[i]);
+	plog(1, "\n");
+	cl->rbuf_bytes += rx;
+	cm11_timer_set(cl->idle_timer, CM11_IDLE_MS);
+	return 1;
+}
+
+static struct cm11_client *cm11_client_new(int ep, int in, int out)
+{
+	struct cm11_client *cl = &cm11_clients[cm11_nclients++];
+	struct epoll_event ev;
+
+	cl->in = in;
+	cl->out = out;
+	cl->pty_slave = -1;
+	cl->state = cm11_state_ready;
+	cl->idle_timer = cm11_timer_new(ep);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = cl;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, in, &ev) < 0)
+		pabort("can't watch the PC");
+	return cl;
+}
+
+/*
+ * A client on a new pseudo-terminal, in raw mode
+ */
+
+static void cm11_pty_new(int ep)
+{
+	struct cm11_client *cl;
+	struct termios tio;
+	const char *name;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+		pabort("can't create pseudo-terminal");
+	name = ptsname(master);
+	cl = cm11_client_new(ep, master, master);
+	// Without it, the master hangs up whenever the PC closes the port
+	cl->pty_slave = open(name, O_RDWR | O_NOCTTY);
+	if (cl->pty_slave < 0)
+		pabort("can't open pseudo-terminal");
+	if (tcgetattr(cl->pty_slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, B4800);
+		tcsetattr(cl->pty_slave, TCSANOW, &tio);
+	}
+	plog(0, "CM11 is on %s\n", name);
+}
+
+/*
+ * With ptys > 0, every PC is on a pseudo-terminal of its own, otherwise
+ * the PC is on stdin and stdout.
+ */
+
+void cm11(int fd, int ptys)
+{
+	struct epoll_event evs[CM11_MAX_CLIENTS + 3];
+	struct cm11_client *cl;
+	int ep, n, i, more, gone = 0;
+
 	cm11_init();
 
-	while(1) {
-		FD_ZERO(&readset);
-		FD_SET(fileno(stdin), &readset);
-		tv.tv_sec = 0;
-		tv.tv_usec = 200000; // 200ms
-		cm11_fresh_rbuf = 0;
-		if (select(fileno(stdin) + 1, &readset, NULL, NULL, &tv) > 0
-			&& FD_ISSET(fileno(stdin), &readset)) {
-			rx = read(fileno(stdin), cm11_rbuf + cm11_rbuf_bytes, 
-				sizeof(cm11_rbuf) - cm11_rbuf_bytes);
-			if (rx < 0)
-				pabort("Error reading stdin");
-			if (rx == 0) {
-				plog(0, "Pipe has been closed by remote\n");
-				return;
-			}
-			plog(1, "RX %d bytes, ", rx);
-			for (i = cm11_rbuf_bytes; i < cm11_rbuf_bytes + rx; i++)
-				plog(1, "%.2x ", cm11_rbuf[i]);
-			plog(1, "\n");
-			cm11_rbuf_bytes += rx;
-			cm11_fresh_rbuf = 1;
+	ep = epoll_create1(0);
+	if (ep < 0)
+		pabort("can't create epoll");
+	cm11_rx_timer = cm11_timer_new(ep);
+	cm11_txq_timer = cm11_timer_new(ep);
+	cm11_timer_set(cm11_rx_timer, 0);
+	if (ptys > CM11_MAX_CLIENTS)
+		fail("Too many CM11 clients");
+	if (ptys == 0)
+		cm11_client_new(ep, fileno(stdin), fileno(stdout));
+	for (i = 0; i < ptys; i++)
+		cm11_pty_new(ep);
+
+	while (!gone) {
+		n = epoll_wait(ep, evs, sizeof(evs) / sizeof(evs[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pabort("epoll failed");
+		}
+
+		// Timers come with data.ptr of NULL
+		for (i = 0; i < n; i++)
+			if (evs[i].data.ptr && !cm11_read(evs[i].data.ptr))
+				gone = 1;
+		// check for incoming X10, when it is time
+		// fills the upload buffers
+		if (cm11_timer_expired(cm11_rx_timer)) {
+			spi_x10_poll(fd);
+			cm11_timer_set(cm11_rx_timer, x10_rx_delay());
 		}
-		// check for incoming X10
-		// sets cm11_has_cbuf
-		spi_x10_poll(fd);
+		// Poll the queue around predicted completion times
+		if (cm11_timer_expired(cm11_txq_timer)) {
+			cm11_txq_armed = 0;
+			x10_txq_pump(fd, &cm11_txq);
+		}
+
+		for (i = 0; i < cm11_nclients; i++) {
+			cl = &cm11_clients[i];
+			if (cm11_timer_expired(cl->idle_timer))
+				cm11_idle(cl);
+			// 0x55 of a command done goes before anything else
+			cm11_write(cl);
 
-		while (cm11_state_machine(fd));
+			// Every answer goes out before the next input is looked at
+			do {
+				more = cm11_state_machine(fd, cl);
+				cm11_write(cl);
+			} while (more);
+		}
+
+		// Rearmed only when it fires, so busy input does not defer it
+		if (cm11_txq.count && !cm11_txq_armed) {
+			cm11_timer_set(cm11_txq_timer, x10_txq_delay(&cm11_txq));
+			cm11_txq_armed = 1;
+		}
+	}
 
-		if (cm11_wbuf_bytes) {
-			write(fileno(stdout), cm11_wbuf, cm11_wbuf_bytes);
-			cm11_wbuf_bytes = 0;
+	for (i = 0; i < cm11_nclients; i++) {
+		cl = &cm11_clients[i];
+		plog(1, "Upload ring of PC %d has filled up %ld times, "
+			"%ld commands dropped\n", cl->in,
+			cl->upload_overflows, cl->upload_drops);
+		close(cl->idle_timer);
+		if (cl->pty_slave >= 0) {
+			close(cl->pty_slave);
+			close(cl->in);
 		}
 	}
+	close(cm11_rx_timer);
+	close(cm11_txq_timer);
+	close(ep);
 }
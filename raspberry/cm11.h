@@ -10,6 +10,8 @@
 #ifndef cm11_h
 #define cm11_h
 
-void cm11(int fd);
+#define CM11_MAX_CLIENTS 8
+
+void cm11(int fd, int ptys);
 
 #endif /* cm11_h */
@@ -0,0 +1,736 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Command daemon code.
+ *
+ * The daemon keeps the SPI devices open and listens on a local Unix
+ * socket. Every line received from a client holds one or more whitespace
+ * separated commands in the command line syntax ("a1:on a2:off",
+ * "f:dim"), "poll" or "stats".
+ * Commands of a line are packed into as few transmissions as possible,
+ * and transmissions of all clients are chained through a single queue
+ * per device. Every command is answered with a single line when it is
+ * done:
+ *
+ *	OK <n>		transaction succeeded, n is reliable_spi_transfer() result
+ *	OK <stats>	statistics of the link
+ *	FAIL <n>	transaction failed
+ *	ERROR <text>	command was refused and not sent
+ *
+ * A line which is not understood is answered with a single ERROR, and
+ * nothing of it is sent.
+ * The answers come in the order of the lines and of the commands in them:
+ * an answer ready early, such as ERROR or stats, is held back until the
+ * answers to the earlier commands are written. A client may wait for up
+ * to DAEMON_ANSWERS answers; a line beyond that is refused. A client
+ * which does not read the answers, so that its socket fills up, or which
+ * has no room left even for the refusal, is disconnected.
+ *
+ * Several devices, on different phases or panels, are given as
+ * "path@houses", where houses are letters and ranges ("a-dk"). Commands
+ * go to the device of their house code; a device without houses takes
+ * all the house codes left. If every device is given houses, commands
+ * for the others are answered with ERROR. Every device is driven by a
+ * thread of its own, with its own transmit queue and receive decoder.
+ * "poll" polls all of them and is answered once; "stats" has a section
+ * per device.
+ *
+ * Between the commands, X10 traffic is received and decoded as in "listen".
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "x10-spi.h"
+#include "daemon.h"
+#include "txqueue.h"
+
+#define DAEMON_MAX_CLIENTS 8
+#define DAEMON_LINE_OCTETS 256
+#define DAEMON_REPLY_OCTETS (DAEMON_LINE_OCTETS*X10_MAX_DEVICES)
+#define DAEMON_JOBS 16		// lines waiting for a device thread
+#define DAEMON_ANSWERS 256	// answers a client may wait for
+#define DAEMON_PATH_OCTETS 108
+
+// Freed when both the socket and the jobs of the client are gone
+struct daemon_client {
+	int fd;		// -1 once disconnected
+	int refs;	// the socket and the jobs not done yet
+	int dropped;	// shut down, as an answer did not fit in
+	unsigned next;	// number of the next answer to promise
+	unsigned sent;	// number of the next answer to write
+	char *answers[DAEMON_ANSWERS];	// ready, waiting for earlier ones
+	int bytes;
+	char buf[DAEMON_LINE_OCTETS];
+};
+
+// A "poll" line, done when all devices are polled
+struct daemon_poll {
+	int pending;
+	int ret;
+	unsigned seq;	// number of the answer
+};
+
+// Commands of a line for one device, or a poll of it
+struct daemon_job {
+	struct daemon_client *cl;
+	struct daemon_poll *poll;	// NULL for commands
+	int count;
+	int done;			// commands answered
+	unsigned seq[X10_BATCH_COMMANDS];	// numbers of their answers
+	struct x10_command cmds[X10_BATCH_COMMANDS];
+};
+
+struct daemon_device {
+	char path[DAEMON_PATH_OCTETS];
+	int target;
+	pthread_t thread;
+	int wake[2];		// pipe, written when a job is queued
+	pthread_mutex_t lock;	// guards the jobs and the statistics
+	struct daemon_job *jobs[DAEMON_JOBS];
+	int njobs;
+	struct x10_prediction_stats pst;
+	struct x10_rx_stats rst;
+	struct x10_link_stats lst;
+};
+
+static struct daemon_client *clients[DAEMON_MAX_CLIENTS];
+static struct daemon_device devs[X10_MAX_DEVICES];
+static int ndevs;
+static int house_dev[16];	// device of every house code, -1 if none
+
+// Guards the clients, their sockets included, and the polls
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with daemon_lock held
+static void daemon_drop(struct daemon_client *cl)
+{
+	plog(0, "Client %d does not read the answers, dropped\n", cl->fd);
+	cl->dropped = 1;
+	shutdown(cl->fd, SHUT_RDWR);
+}
+
+/*
+ * Give the answer number seq, then write every answer that is next in
+ * order
+ */
+
+static void daemon_reply(struct daemon_client *cl, unsigned seq,
+	const char *str, ...)
+{
+	char line[DAEMON_REPLY_OCTETS];
+	va_list args;
+	char *answer;
+	int len;
+
+	va_start(args, str);
+	vsnprintf(line, sizeof(line), str, args);
+	va_end(args);
+	answer = strdup(line);
+	if (!answer)
+		fail("Out of memory");
+	pthread_mutex_lock(&daemon_lock);
+	cl->answers[seq % DAEMON_ANSWERS] = answer;
+	while ((answer = cl->answers[cl->sent % DAEMON_ANSWERS]) != NULL) {
+		cl->answers[cl->sent % DAEMON_ANSWERS] = NULL;
+		cl->sent++;
+		len = strlen(answer);
+		// The client may be gone already, it will be noticed on
+		// read. The socket does not block, so a client which does
+		// not read cannot stall the device threads waiting for
+		// this lock.
+		if (cl->fd != -1 && !cl->dropped
+			&& write(cl->fd, answer, len) != len)
+			daemon_drop(cl);
+		free(answer);
+	}
+	pthread_mutex_unlock(&daemon_lock);
+}
+
+/*
+ * Number n answers to come, in the order they are to be written.
+ * Returns: 0 on success, -1 if the client waits for too many already
+ */
+
+static int daemon_promise(struct daemon_client *cl, int n, unsigned *seq)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&daemon_lock);
+	if (cl->next - cl->sent + n <= DAEMON_ANSWERS) {
+		*seq = cl->next;
+		cl->next += n;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&daemon_lock);
+	return ret;
+}
+
+/*
+ * Answer a line with a single ERROR. A client with no room even for that
+ * does not read the answers.
+ */
+
+static void daemon_refuse(struct daemon_client *cl, const char *err)
+{
+	unsigned seq;
+
+	if (daemon_promise(cl, 1, &seq) < 0) {
+		pthread_mutex_lock(&daemon_lock);
+		if (cl->fd != -1 && !cl->dropped)
+			daemon_drop(cl);
+		pthread_mutex_unlock(&daemon_lock);
+		return;
+	}
+	daemon_reply(cl, seq, "ERROR %s\n", err);
+}
+
+static void daemon_client_put(struct daemon_client *cl)
+{
+	int gone;
+
+	pthread_mutex_lock(&daemon_lock);
+	gone = --cl->refs == 0;
+	pthread_mutex_unlock(&daemon_lock);
+	if (gone)
+		free(cl);
+}
+
+static void daemon_job_done(struct daemon_job *job)
+{
+	daemon_client_put(job->cl);
+	free(job);
+}
+
+// The commands left are not sent
+static void daemon_job_fail(struct daemon_job *job, const char *err)
+{
+	while (job->done < job->count)
+		daemon_reply(job->cl, job->seq[job->done++], "ERROR %s\n", err);
+	daemon_job_done(job);
+}
+
+/*
+ * Transmit queue callback: the commands are done, answer the client.
+ */
+
+static void daemon_report(void *owner, int ret, int ncmds)
+{
+	struct daemon_job *job = owner;
+
+	while (ncmds-- > 0)
+		daemon_reply(job->cl, job->seq[job->done++], "%s %d\n",
+			ret ? "OK" : "FAIL", ret);
+	if (job->done >= job->count)
+		daemon_job_done(job);
+}
+
+/*
+ * Hand the job to the thread of the device
+ */
+
+static void daemon_queue(struct daemon_device *dev, struct daemon_job *job)
+{
+	int queued = 0;
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->njobs < DAEMON_JOBS) {
+		dev->jobs[dev->njobs++] = job;
+		queued = 1;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	if (queued) {
+		if (write(dev->wake[1], "", 1) != 1)
+			plog(1, "Cannot wake the thread of %s\n", dev->path);
+		return;
+	}
+	if (job->poll) {
+		// Not polled, so the poll has failed
+		pthread_mutex_lock(&daemon_lock);
+		job->poll->ret = 0;
+		queued = --job->poll->pending == 0;
+		pthread_mutex_unlock(&daemon_lock);
+		if (queued) {
+			daemon_reply(job->cl, job->poll->seq, "FAIL 0\n");
+			free(job->poll);
+		}
+		daemon_job_done(job);
+	} else {
+		daemon_job_fail(job, "Too many commands");
+	}
+}
+
+static struct daemon_job *daemon_job_new(struct daemon_client *cl)
+{
+	struct daemon_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		fail("Out of memory");
+	job->cl = cl;
+	pthread_mutex_lock(&daemon_lock);
+	cl->refs++;
+	pthread_mutex_unlock(&daemon_lock);
+	return job;
+}
+
+static void daemon_stats(struct daemon_client *cl, unsigned seq)
+{
+	char line[DAEMON_REPLY_OCTETS];
+	struct x10_prediction_stats pst;
+	struct x10_rx_stats rst;
+	struct x10_link_stats lst;
+	int i, len = 0;
+
+	for (i = 0; i < ndevs && len < sizeof(line); i++) {
+		pthread_mutex_lock(&devs[i].lock);
+		pst = devs[i].pst;
+		rst = devs[i].rst;
+		lst = devs[i].lst;
+		pthread_mutex_unlock(&devs[i].lock);
+		if (ndevs > 1)
+			len += snprintf(line + len, sizeof(line) - len,
+				"%s%s: ", i ? " | " : "", devs[i].path);
+		if (len >= sizeof(line))
+			break;
+		len += snprintf(line + len, sizeof(line) - len,
+			"predictions %d mean %lld us "
+			"earliest %ld us latest %ld us; "
+			"polls %ld bits %ld max_fill %d "
+			"latency %lld us max %ld us "
+			"overruns %ld lost %ld delta %ld octets %lld "
+			"records %ld lost_records %ld; "
+			"replies %ld crc_errors %ld",
+			pst.samples,
+			pst.samples ? pst.sum_error_us / pst.samples : 0,
+			pst.max_early_us, pst.max_late_us,
+			rst.polls, rst.bits, rst.max_fill,
+			rst.polls ? rst.latency_sum_us / rst.polls : 0,
+			rst.max_latency_us, rst.overruns, rst.lost_bits,
+			rst.delta_polls, rst.spi_octets,
+			rst.record_polls, rst.lost_records,
+			lst.replies, lst.crc_errors);
+	}
+	daemon_reply(cl, seq, "OK %s\n", line);
+}
+
+static void daemon_execute(struct daemon_client *cl, char *line)
+{
+	struct daemon_job *jobs[X10_MAX_DEVICES];
+	struct daemon_poll *poll;
+	struct x10_command cmds[X10_BATCH_COMMANDS];
+	int devof[X10_BATCH_COMMANDS];
+	char *word, *save;
+	const char *err;
+	char why[32];
+	unsigned seq;
+	int i, count, dev;
+
+	plog(1, "Processing daemon command: %s\n", line);
+
+	if (strcmp(line, "poll") == 0) {
+		if (daemon_promise(cl, 1, &seq) < 0) {
+			daemon_refuse(cl, "Too many commands");
+			return;
+		}
+		poll = malloc(sizeof(*poll));
+		if (!poll)
+			fail("Out of memory");
+		poll->pending = ndevs;
+		poll->ret = -1;
+		poll->seq = seq;
+		for (i = 0; i < ndevs; i++) {
+			jobs[i] = daemon_job_new(cl);
+			jobs[i]->poll = poll;
+		}
+		for (i = 0; i < ndevs; i++)
+			daemon_queue(&devs[i], jobs[i]);
+		return;
+	}
+
+	if (strcmp(line, "stats") == 0) {
+		if (daemon_promise(cl, 1, &seq) < 0)
+			daemon_refuse(cl, "Too many commands");
+		else
+			daemon_stats(cl, seq);
+		return;
+	}
+
+	count = 0;
+	for (word = strtok_r(line, " \t", &save); word;
+		word = strtok_r(NULL, " \t", &save)) {
+		if (count == X10_BATCH_COMMANDS) {
+			daemon_refuse(cl, "Too many commands");
+			return;
+		}
+		err = parse_command(word, &cmds[count]);
+		if (err) {
+			daemon_refuse(cl, err);
+			return;
+		}
+		devof[count] = house_dev[cmds[count].hc];
+		if (devof[count] < 0) {
+			snprintf(why, sizeof(why), "No device for house %c",
+				'a' + cmds[count].hc);
+			daemon_refuse(cl, why);
+			return;
+		}
+		count++;
+	}
+	if (daemon_promise(cl, count, &seq) < 0) {
+		daemon_refuse(cl, "Too many commands");
+		return;
+	}
+
+	// The answers come from daemon_report() when the queues get there
+	for (dev = 0; dev < ndevs; dev++) {
+		jobs[dev] = NULL;
+		for (i = 0; i < count; i++) {
+			if (devof[i] != dev)
+				continue;
+			if (!jobs[dev])
+				jobs[dev] = daemon_job_new(cl);
+			jobs[dev]->seq[jobs[dev]->count] = seq + i;
+			jobs[dev]->cmds[jobs[dev]->count++] = cmds[i];
+		}
+		if (jobs[dev])
+			daemon_queue(&devs[dev], jobs[dev]);
+	}
+}
+
+static void daemon_close(struct daemon_client **slot)
+{
+	struct daemon_client *cl = *slot;
+
+	plog(1, "Client %d disconnected\n", cl->fd);
+	// Jobs of the client keep running, with nobody to answer
+	pthread_mutex_lock(&daemon_lock);
+	close(cl->fd);
+	cl->fd = -1;
+	pthread_mutex_unlock(&daemon_lock);
+	*slot = NULL;
+	daemon_client_put(cl);
+}
+
+/*
+ * Read from the client and execute every complete line.
+ */
+
+static void daemon_receive(struct daemon_client **slot)
+{
+	struct daemon_client *cl = *slot;
+	int rx;
+	char *line, *eol;
+
+	rx = read(cl->fd, cl->buf + cl->bytes, sizeof(cl->buf) - cl->bytes - 1);
+	if (rx < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (rx <= 0) {
+		daemon_close(slot);
+		return;
+	}
+	cl->bytes += rx;
+	cl->buf[cl->bytes] = 0;
+
+	line = cl->buf;
+	while ((eol = strchr(line, '\n')) != NULL) {
+		*eol = 0;
+		if (eol > line && *(eol - 1) == '\r')
+			*(eol - 1) = 0;
+		if (*line)
+			daemon_execute(cl, line);
+		line = eol + 1;
+	}
+	cl->bytes -= line - cl->buf;
+	memmove(cl->buf, line, cl->bytes);
+
+	if (cl->bytes == sizeof(cl->buf) - 1) {
+		daemon_refuse(cl, "Line too long");
+		daemon_close(slot);
+	}
+}
+
+static void daemon_accept(int sock)
+{
+	int i, cl_fd;
+
+	cl_fd = accept(sock, NULL, NULL);
+	if (cl_fd < 0) {
+		plog(0, "Cannot accept client: %s\n", strerror(errno));
+		return;
+	}
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+		if (!clients[i])
+			break;
+	if (i == DAEMON_MAX_CLIENTS) {
+		plog(0, "Too many clients\n");
+		close(cl_fd);
+		return;
+	}
+	// Answers are written by the device threads, see daemon_reply()
+	if (fcntl(cl_fd, F_SETFL, O_NONBLOCK) < 0)
+		pabort("can't make the client socket non-blocking");
+	clients[i] = calloc(1, sizeof(*clients[i]));
+	if (!clients[i])
+		fail("Out of memory");
+	plog(1, "Client %d connected\n", cl_fd);
+	clients[i]->fd = cl_fd;
+	clients[i]->refs = 1;
+}
+
+static int daemon_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fail("Socket path is too long");
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		pabort("can't create socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	// Remove stale socket left by previous instance
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		pabort("can't bind socket");
+	if (listen(sock, DAEMON_MAX_CLIENTS) < 0)
+		pabort("can't listen on socket");
+
+	return sock;
+}
+
+static void daemon_display(void *data, struct x10_command *cmd)
+{
+	struct daemon_device *dev = data;
+
+	// Keep the lines of a command together
+	flockfile(stderr);
+	if (ndevs > 1)
+		plog(0, "Received on %s:\n", dev->path);
+	log_command(0, cmd);
+	funlockfile(stderr);
+}
+
+/*
+ * Returns: 1 if the transmit queue has no room for the job now
+ */
+
+static int daemon_run_job(int fd, struct daemon_device *dev,
+	struct x10_tx_queue *txq, struct daemon_job *job)
+{
+	struct spi_message spi_rx_msg;
+	int ret, last;
+
+	if (!job->poll) {
+		ret = x10_txq_push(fd, txq, job->cmds, job->count, dev->target,
+			job);
+		if (ret < 0)
+			daemon_job_fail(job, "Too many commands");
+		return ret > 0;
+	}
+
+	ret = reliable_spi_transfer(fd, NULL, &spi_rx_msg, 0);
+	pthread_mutex_lock(&daemon_lock);
+	// The first failure is the answer
+	if (job->poll->ret != 0)
+		job->poll->ret = ret;
+	last = --job->poll->pending == 0;
+	ret = job->poll->ret;
+	pthread_mutex_unlock(&daemon_lock);
+	if (last) {
+		daemon_reply(job->cl, job->poll->seq, "%s %d\n",
+			ret ? "OK" : "FAIL", ret);
+		free(job->poll);
+	}
+	daemon_job_done(job);
+	return 0;
+}
+
+/*
+ * The thread of a device: an endless loop running its jobs and polling
+ * X10 through SPI
+ */
+
+static void *daemon_device_loop(void *arg)
+{
+	struct daemon_device *dev = arg;
+	struct daemon_job *jobs[DAEMON_JOBS];
+	struct x10_tx_queue txq;
+	fd_set readset;
+	struct timeval tv;
+	long next_pump = 0, now, wait;
+	int fd, i, njobs;
+	char drain[DAEMON_JOBS];
+
+	fd = x10_device_open(dev->path);
+	feed_octet_callback = &x10_decode_octet;
+	flush_bits_callback = &x10_decode_flush;
+	x10_decode_init(&daemon_display, dev);
+	x10_txq_init(&txq, &daemon_report);
+
+	while (1) {
+		FD_ZERO(&readset);
+		FD_SET(dev->wake[0], &readset);
+
+		now = monotonic_us() / 1000;
+		wait = x10_rx_delay();
+		if (txq.count && next_pump - now < wait)
+			wait = next_pump - now;
+		if (wait < 0)
+			wait = 0;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+
+		if (select(dev->wake[0] + 1, &readset, NULL, NULL, &tv) < 0) {
+			if (errno == EINTR)
+				continue;
+			pabort("select failed");
+		}
+
+		if (FD_ISSET(dev->wake[0], &readset)
+			&& read(dev->wake[0], drain, sizeof(drain)) < 0)
+			pabort("can't read the wake pipe");
+
+		// Commands may take long, so keep receiving in time
+		if (x10_rx_delay() == 0)
+			spi_x10_poll(fd);
+		now = monotonic_us() / 1000;
+		// Poll the queue around predicted completion times
+		if (txq.count && now >= next_pump) {
+			x10_txq_pump(fd, &txq);
+			next_pump = now + x10_txq_delay(&txq);
+		}
+
+		// Only this thread takes the jobs, others append to them
+		pthread_mutex_lock(&dev->lock);
+		njobs = dev->njobs;
+		memcpy(jobs, dev->jobs, njobs * sizeof(jobs[0]));
+		pthread_mutex_unlock(&dev->lock);
+		// A job the queue has no room for waits for the next pump,
+		// and the jobs after it wait too
+		for (i = 0; i < njobs; i++)
+			if (daemon_run_job(fd, dev, &txq, jobs[i]))
+				break;
+		pthread_mutex_lock(&dev->lock);
+		dev->njobs -= i;
+		memmove(dev->jobs, dev->jobs + i,
+			dev->njobs * sizeof(dev->jobs[0]));
+		pthread_mutex_unlock(&dev->lock);
+
+		pthread_mutex_lock(&dev->lock);
+		x10_prediction_get(&dev->pst);
+		x10_rx_stats_get(&dev->rst);
+		x10_link_stats_get(&dev->lst);
+		pthread_mutex_unlock(&dev->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Split "path@houses" and give the houses to the device
+ */
+
+static void daemon_add_device(const char *spec, int target, int *claimed)
+{
+	struct daemon_device *dev = &devs[ndevs];
+	const char *at = strrchr(spec, '@');
+	const char *h;
+	int len, from, to;
+
+	len = at ? at - spec : strlen(spec);
+	if (len >= sizeof(dev->path))
+		fail("Device path is too long");
+	memcpy(dev->path, spec, len);
+	dev->path[len] = 0;
+	dev->target = target;
+
+	for (h = at ? at + 1 : ""; *h; h++) {
+		from = tolower(*h) - 'a';
+		to = from;
+		if (h[1] == '-' && h[2]) {
+			to = tolower(h[2]) - 'a';
+			h += 2;
+		}
+		if (from < 0 || to > 15 || from > to)
+			fail("Houses are letters a to p");
+		for (; from <= to; from++) {
+			if (claimed[from])
+				fail("A house is given to two devices");
+			claimed[from] = 1;
+			house_dev[from] = ndevs;
+		}
+	}
+	ndevs++;
+}
+
+/*
+ * This is an endless loop serving the clients, while the device threads
+ * poll X10 through SPI
+ */
+
+void x10_daemon(const char **devices, int ndevices, const char *path,
+	int target)
+{
+	fd_set readset;
+	int claimed[16], rest = -1;
+	int sock, max_fd, i;
+
+	signal(SIGPIPE, SIG_IGN);
+	sock = daemon_socket(path);
+
+	memset(claimed, 0, sizeof(claimed));
+	for (i = 0; i < ndevices; i++) {
+		if (!strchr(devices[i], '@') && rest < 0)
+			rest = i;
+		daemon_add_device(devices[i], target, claimed);
+	}
+	for (i = 0; i < 16; i++)
+		if (!claimed[i])
+			house_dev[i] = rest;
+
+	for (i = 0; i < ndevs; i++) {
+		if (pipe(devs[i].wake) < 0)
+			pabort("can't create pipe");
+		pthread_mutex_init(&devs[i].lock, NULL);
+		if (pthread_create(&devs[i].thread, NULL, &daemon_device_loop,
+			&devs[i]) != 0)
+			fail("Cannot start a device thread");
+	}
+
+	plog(0, "Listening on %s\n", path);
+
+	while (1) {
+		FD_ZERO(&readset);
+		FD_SET(sock, &readset);
+		max_fd = sock;
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			if (!clients[i])
+				continue;
+			FD_SET(clients[i]->fd, &readset);
+			if (clients[i]->fd > max_fd)
+				max_fd = clients[i]->fd;
+		}
+
+		if (select(max_fd + 1, &readset, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			pabort("select failed");
+		}
+
+		if (FD_ISSET(sock, &readset))
+			daemon_accept(sock);
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+			if (clients[i] && FD_ISSET(clients[i]->fd, &readset))
+				daemon_receive(&clients[i]);
+	}
+}
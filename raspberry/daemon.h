@@ -0,0 +1,18 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Command daemon code.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef daemon_h
+#define daemon_h
+
+#define X10_DAEMON_SOCKET "/var/run/x10-spi.sock"
+
+void x10_daemon(const char **devices, int ndevices, const char *path,
+	int target);
+
+#endif /* daemon_h */
@@ -0,0 +1,313 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * X10 bitstream decoder.
+ *
+ * The decoder keeps its whole state in struct x10_decoder, so any number
+ * of bitstreams can be decoded at once. Every decoded code is passed to
+ * the commit callback together with its repetition count, when the code
+ * is followed by a different one, or by a pause.
+ *
+ * Bits are fed one by one, or an octet at a time. Octets where nothing
+ * but shifting happens are handled through lookup tables; an octet where
+ * the state changes is fed bit by bit, so both ways give the same result.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#include "decoder.h"
+
+static int x10_deinterleave(uint32_t buf, uint8_t bits)
+{
+	int tmp = 0;
+	int check = 0;
+	int i;
+
+	for (i = bits ; i > 0; --i) {
+		tmp <<= 1;
+		check <<= 1;
+		if (buf & (1L << (i * 2 - 1)))
+			tmp += 1;
+		if (!(buf & (1L << (i * 2 - 2))))
+			check += 1;
+		if (check != tmp)
+			return -1;
+	}
+	return tmp;
+}
+
+/*
+ * Lookup tables for the octet decoder, indexed by the octet and
+ * a few bits received before it.
+ */
+
+#define X10_PAIR_INVALID 0x80
+
+// first bit completing a start code (1..8), 0 if none;
+// index is 3 previous bits and the octet
+static uint8_t start_bit[8*256];
+// first bit completing a run of 6 zeros (1..8), 0 if none;
+// index is trailing zeros before the octet (0..5) and the octet
+static uint8_t zeros_bit[6*256];
+// 4 data bits of the bit pairs ending in the octet, or X10_PAIR_INVALID;
+// index is the octet when aligned to pairs, otherwise 256 plus
+// the previous bit and the octet
+static uint8_t pair_bits[3*256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void x10_decoder_tables(void)
+{
+	uint32_t buf;
+	int prev, octet, i, run, data;
+
+	for (prev = 0; prev < 8; prev++)
+		for (octet = 0; octet < 256; octet++) {
+			buf = prev;
+			start_bit[prev*256 + octet] = 0;
+			for (i = 1; i <= 8; i++) {
+				buf = (buf << 1) | ((octet >> (8 - i)) & 1);
+				if ((buf & 0xF) == 0xE) {
+					start_bit[prev*256 + octet] = i;
+					break;
+				}
+			}
+		}
+
+	for (prev = 0; prev < 6; prev++)
+		for (octet = 0; octet < 256; octet++) {
+			run = prev;
+			zeros_bit[prev*256 + octet] = 0;
+			for (i = 1; i <= 8; i++) {
+				run = ((octet >> (8 - i)) & 1) ? 0 : run + 1;
+				if (run >= 6) {
+					zeros_bit[prev*256 + octet] = i;
+					break;
+				}
+			}
+		}
+
+	for (i = 0; i < 3*256; i++) {
+		// bits to deinterleave, pairs aligned to the end
+		buf = (i < 256) ? i : ((i - 256) >> 1);
+		data = 0;
+		for (prev = 3; prev >= 0; prev--) {
+			run = x10_deinterleave(buf >> (prev * 2), 1);
+			if (run == -1) {
+				data = X10_PAIR_INVALID;
+				break;
+			}
+			data = (data << 1) | run;
+		}
+		pair_bits[i] = data;
+	}
+}
+
+void x10_decoder_init(struct x10_decoder *d,
+	void (*commit)(void *data, struct x10_command *cmd), void *data)
+{
+	// The daemon starts a decoder in every device thread
+	pthread_once(&tables_once, x10_decoder_tables);
+	memset(d, 0, sizeof(*d));
+	d->state = X10_STATE_IDLE;
+	d->commit = commit;
+	d->data = data;
+}
+
+/*
+ * Pass the last received code, with its repetitions, to the callback.
+ */
+
+static void x10_decoder_commit(struct x10_decoder *d)
+{
+	struct x10_command a_cmd;
+
+	plog(1, "Committing the command!\n");
+	memset(&a_cmd, 0, sizeof(a_cmd));
+	a_cmd.hc=_x10_decode[(d->last_rbuf >> 25) & 0xF];
+	if ((d->last_rbuf >> 20) & 1) {
+		a_cmd.fc = _x10_decode[(d->last_rbuf >> 21) & 0xF];
+		a_cmd.func_rpt = d->repeats;
+	} else {
+		a_cmd.uc = _x10_decode[(d->last_rbuf >> 21) & 0xF];
+		a_cmd.addr_rpt = d->repeats;
+	}
+	if (a_cmd.fc == X10_FUNC_EXTENDEDCODE) {
+		a_cmd.uc = _x10_decode[(d->last_rbuf >> 16) & 0xF];
+		a_cmd.x_byte_1 = (d->last_rbuf >> 8) & 0xFF;
+		a_cmd.x_byte_2 = d->last_rbuf & 0xFF;
+	}
+	(*d->commit)(d->data, &a_cmd);
+	d->last_rbuf = 0;
+	d->repeats = 0;
+}
+
+/*
+ * Decodes X10 bitstream and executes callback function
+ * when a valid transmission is found.
+ */
+
+void x10_decoder_feed(struct x10_decoder *d, uint8_t bit)
+{
+	int tmp;
+	int commit_command = 0;
+
+	d->buf = (d->buf << 1) + bit;
+	d->counter++;
+
+	if (d->state != X10_STATE_IDLE && (d->buf & 0b111111) == 0) {
+		plog(1, "Force return to idle state\n");
+		d->state = X10_STATE_IDLE;
+		d->buf = 0;
+	}
+
+	switch (d->state) {
+	case X10_STATE_IDLE:
+		if (d->last_rbuf && d->counter == 5)
+			commit_command = 1;
+		if ((d->buf & 0xF) != 0xE)
+			break;
+		plog(1, "Start condition detected\n");
+		d->counter = 0;
+		d->rbuf = 0;
+		d->state = X10_STATE_BASIC;
+		break;
+	case X10_STATE_BASIC:
+	case X10_STATE_EXTENDED:
+		if (d->counter % 2)
+			break;
+		tmp = x10_deinterleave(d->buf, 1);
+		if (tmp == -1) {
+			plog(1, "The transmission is invalid\n");
+			d->state = X10_STATE_RECOVER;
+			break;
+		}
+		d->rbuf = (d->rbuf << 1) + tmp;
+		if (d->counter < 18)
+			break;
+		if (d->counter == 18) {
+			if ((d->rbuf & 1) && _x10_decode[(d->rbuf >> 1) & 0xF] 
+				== X10_FUNC_EXTENDEDCODE) {
+				d->state = X10_STATE_EXTENDED;
+				break;
+			}
+			d->rbuf <<= 20;
+			d->state = X10_STATE_RECEIVED;
+		}
+		if (d->counter < 58)
+			break;
+		d->state = X10_STATE_RECEIVED;
+		break;
+	default:
+		break;
+	}
+
+	if (d->state == X10_STATE_RECEIVED) {
+		plog(1, "The received code seems valid: %.8X\n", d->rbuf);
+		// This is a mark to distinguish empty code from zero code
+		d->rbuf |= 1<<31; 
+		if (d->last_rbuf) {
+			if (d->last_rbuf == d->rbuf) {
+				d->repeats++;
+				plog(1, "The code is same as before\n");
+			} else {
+				commit_command = 1;
+				d->repeats = 1;
+			}
+		} else {
+			d->repeats = 1;
+		}
+	}
+
+	if (d->last_rbuf && d->state == X10_STATE_RECOVER)
+		commit_command = 1;
+
+	if (commit_command)
+		x10_decoder_commit(d);
+
+	if (d->state == X10_STATE_RECEIVED) {
+		d->last_rbuf = d->rbuf;
+		d->buf = 0;
+		d->counter = 0;
+		d->state = X10_STATE_IDLE;
+	}
+}
+
+/*
+ * There is a gap in the bitstream: commit what was received before it
+ * and start over, rather than decode across the gap.
+ */
+
+void x10_decoder_flush(struct x10_decoder *d)
+{
+	if (d->last_rbuf)
+		x10_decoder_commit(d);
+	d->state = X10_STATE_IDLE;
+	d->buf = 0;
+	d->counter = 0;
+}
+
+/*
+ * Decode an octet of the bitstream, most significant bit first.
+ */
+
+void x10_decoder_feed_octet(struct x10_decoder *d, uint8_t octet)
+{
+	int i, index, end;
+	uint8_t data;
+
+	switch (d->state) {
+	case X10_STATE_IDLE:
+		// A pending code is committed 5 bits after the last one
+		if (d->last_rbuf && d->counter < 5)
+			break;
+		end = start_bit[(d->buf & 7)*256 + octet];
+		if (!end) {
+			d->buf = (d->buf << 8) | octet;
+			d->counter += 8;
+			return;
+		}
+		// Shift up to the start code, the rest goes bit by bit
+		d->buf = (d->buf << (end - 1)) | (octet >> (9 - end));
+		d->counter += end - 1;
+		for (i = 8 - end; i >= 0; i--)
+			x10_decoder_feed(d, (octet >> i) & 1);
+		return;
+	case X10_STATE_RECOVER:
+		if (zeros_bit[__builtin_ctz(d->buf & 0x3F)*256 + octet])
+			break;
+		d->buf = (d->buf << 8) | octet;
+		d->counter += 8;
+		return;
+	case X10_STATE_BASIC:
+	case X10_STATE_EXTENDED:
+		// The code ends, or its type is decided, within the octet
+		end = (d->state == X10_STATE_BASIC) ? 18 : 58;
+		if (d->counter < end && d->counter + 8 >= end)
+			break;
+		// The pair straddling the next octet is decoded bit by bit
+		index = (d->counter % 2) ? 256 + ((d->buf & 1) << 8) + octet
+			: octet;
+		data = pair_bits[index];
+		if (data & X10_PAIR_INVALID)
+			break;
+		d->rbuf = (d->rbuf << 4) | data;
+		d->buf = (d->buf << 8) | octet;
+		d->counter += 8;
+		return;
+	default:
+		break;
+	}
+
+	for (i = 7; i >= 0; i--)
+		x10_decoder_feed(d, (octet >> i) & 1);
+}
+
+/*
+ * Tell if the octet, received after the bits in prev, has a start code.
+ */
+
+int x10_start_code(uint32_t prev, uint8_t octet)
+{
+	return start_bit[(prev & 7)*256 + octet] != 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * X10 bitstream decoder.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef decoder_h
+#define decoder_h
+
+#include "x10-spi.h"
+
+enum x10_state {
+	X10_STATE_IDLE,
+	X10_STATE_BASIC,
+	X10_STATE_EXTENDED,
+	X10_STATE_RECOVER,
+	X10_STATE_RECEIVED,
+};
+
+struct x10_decoder {
+	enum x10_state state;
+	uint32_t buf;		// recent bits, as received
+	uint32_t rbuf;		// code being received, deinterleaved
+	uint32_t last_rbuf;	// code received last, not committed yet
+	int counter;		// bits since the start code
+	int repeats;		// repetitions of last_rbuf
+	void (*commit)(void *data, struct x10_command *cmd);
+	void *data;		// passed to commit()
+};
+
+void x10_decoder_init(struct x10_decoder *d,
+	void (*commit)(void *data, struct x10_command *cmd), void *data);
+void x10_decoder_feed(struct x10_decoder *d, uint8_t bit);
+void x10_decoder_feed_octet(struct x10_decoder *d, uint8_t octet);
+void x10_decoder_flush(struct x10_decoder *d);
+int x10_start_code(uint32_t prev, uint8_t octet);
+
+#endif /* decoder_h */
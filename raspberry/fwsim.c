@@ -0,0 +1,212 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Module firmware simulator.
+ *
+ * The firmware (../main.c) is built for the host, with the registers of
+ * sim/avr/io.h. The simulator plays the hardware around it: the mains
+ * zero crossings, the X10 line and the USI shifter. Interrupt handlers
+ * are called in between the passes of the main loop, so they never cut
+ * into it, which is a bit kinder than the real chip.
+ *
+ * The mains clock runs from the time given by the host, at the mains
+ * frequency the host assumes. A high frequency runs the protocol faster
+ * than real time. The line loops back: the module receives what it
+ * sends.
+ *
+ * The Makefile builds this file once more with X10_DECODE, for the
+ * firmware which decodes the frames itself. Its functions are then named
+ * fwsim_decode_*, and every other symbol of that copy is made local.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#include <stdlib.h>
+
+#ifdef X10_DECODE
+#define fwsim_init fwsim_decode_init
+#define fwsim_run fwsim_decode_run
+#define fwsim_transfer fwsim_decode_transfer
+#define fwsim_stats_get fwsim_decode_stats_get
+#define fwsim_reply_crc_check fwsim_decode_reply_crc_check
+#endif
+
+#include "fwsim.h"
+
+// The firmware is built with -fpack-struct for the ATtiny26
+#pragma pack(push, 1)
+#define X10_SIM
+#include "../main.c"
+#pragma pack(pop)
+
+volatile uint8_t DDRA, PORTA, PINA, DDRB, PORTB, PINB;
+volatile uint8_t USICR, USISR, USIDR;
+volatile uint8_t GIMSK, MCUCR, TIMSK, TIFR, SREG;
+volatile uint8_t TCCR1B, TCNT1, OCR1A, OCR1B;
+
+// Passes of the main loop after every event, enough to handle it
+#define FWSIM_LOOPS 4
+
+static struct {
+	int mains_hz;
+	int error_ppm;		// SPI octets damaged, per million
+	unsigned int seed;
+	int64_t start_us;	// time of crossing 0, -1 before the first run
+	struct fwsim_stats stats;
+} sim = { .start_us = -1 };
+
+static void fwsim_loop(void)
+{
+	int i;
+
+	for (i = 0; i < FWSIM_LOOPS; i++)
+		main_loop();
+}
+
+/*
+ * Start the firmware. Calling this again restarts the mains clock and
+ * the counters, but the firmware keeps its state, like after a glitch.
+ */
+
+void fwsim_init(int mains_hz, int error_ppm)
+{
+	sim.mains_hz = mains_hz;
+	sim.error_ppm = error_ppm;
+	sim.seed = 1;
+	sim.start_us = -1;
+	memset(&sim.stats, 0, sizeof(sim.stats));
+	// SS is released, and the line is quiet (the input is active low)
+	PINB = _BV(SPI_SS) | _BV(X10_IN);
+	main_init();
+	fwsim_loop();
+}
+
+/*
+ * A mains zero crossing: the module sends its bit, then samples the line.
+ */
+
+static void fwsim_crossing(void)
+{
+	INT0_vect();
+	if (PORT_X10 & _BV(X10_OUT)) {
+		PIN_X10 &= ~_BV(X10_IN);
+		sim.stats.bits_sent++;
+	} else {
+		PIN_X10 |= _BV(X10_IN);
+	}
+	if (TIMSK & _BV(OCIE1A))
+		TIMER1_CMPA_vect();
+	if (TIMSK & _BV(OCIE1B))
+		TIMER1_CMPB_vect();
+	sim.stats.crossings++;
+	fwsim_loop();
+}
+
+/*
+ * Simulate every zero crossing up to now_us.
+ */
+
+void fwsim_run(int64_t now_us)
+{
+	long crossings;
+
+	if (sim.start_us < 0)
+		sim.start_us = now_us;
+	crossings = (now_us - sim.start_us) * 2 * sim.mains_hz / 1000000;
+	while (sim.stats.crossings < crossings)
+		fwsim_crossing();
+}
+
+/*
+ * Damage an octet now and then, to exercise the retries.
+ */
+
+static uint8_t fwsim_noise(uint8_t octet)
+{
+	int r;
+
+	if (sim.error_ppm == 0)
+		return octet;
+	r = rand_r(&sim.seed);
+	if (r % 1000000 >= sim.error_ppm)
+		return octet;
+	sim.stats.corrupted++;
+	return octet ^ (1 << (r >> 20 & 7));
+}
+
+/*
+ * A SPI transaction: CS is asserted, the octets are shifted, CS is
+ * released and the module has time to process the request.
+ */
+
+void fwsim_transfer(const uint8_t *tx, uint8_t *rx, int len)
+{
+	int i;
+
+	PIN_SPI &= ~_BV(SPI_SS);
+	IO_PINS_vect();
+	// The host may hold CS before clocking, see spi_tx_commit()
+	fwsim_loop();
+	for (i = 0; i < len; i++) {
+		rx[i] = fwsim_noise(USIDR);
+		USIDR = fwsim_noise(tx[i]);
+		USI_OVF_vect();
+	}
+	PIN_SPI |= _BV(SPI_SS);
+	IO_PINS_vect();
+	fwsim_loop();
+
+	sim.stats.transfers++;
+	sim.stats.octets += len;
+}
+
+void fwsim_stats_get(struct fwsim_stats *st)
+{
+	*st = sim.stats;
+}
+
+/*
+ * Change the reply at random, as the main loop does, and let
+ * spi_tx_commit() apply it, with the SPI idle or selected before the
+ * first clock. The CRC it keeps must be that of the whole message, and
+ * a selected SPI must have the new first octet preloaded. The firmware
+ * state is restored afterwards.
+ * Returns: number of wrong CRCs or preloads
+ */
+
+long fwsim_reply_crc_check(long count)
+{
+	spi_message_t saved_msg = spi_tx_message;
+	spi_status_t saved_status = spi_status;
+	uint8_t saved_counter = spi_counter;
+	uint8_t saved_usidr = USIDR;
+	spi_tx_next_t next;
+	unsigned int seed = 1;
+	long i, bad = 0;
+	int r;
+
+	spi_counter = 0;
+	for (i = 0; i < count; i++) {
+		r = rand_r(&seed);
+		next.rr_code = r;
+		next.rr_id = r >> 8;
+		next.octet = r >> 16;
+		next.has_octet = (r >> 24) & 1;
+		next.dirty = 1;
+		spi_status.running = (r >> 25) & 1;
+		USIDR = 0xFE;
+		spi_tx_commit(next);
+		if (spi_tx_message.crc16 != spi_crc16(
+			(const uint8_t *)&spi_tx_message, sizeof(spi_tx_message)-2))
+			bad++;
+		else if (spi_status.running && USIDR != next.rr_code)
+			bad++;
+	}
+
+	spi_tx_message = saved_msg;
+	spi_status = saved_status;
+	spi_counter = saved_counter;
+	USIDR = saved_usidr;
+	return bad;
+}
@@ -0,0 +1,36 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Module firmware simulator.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef fwsim_h
+#define fwsim_h
+
+#include <stdint.h>
+
+struct fwsim_stats {
+	long crossings;		// mains zero crossings simulated
+	long bits_sent;		// of them with an X10 burst from the module
+	long transfers;		// SPI transactions
+	long octets;
+	long corrupted;		// octets damaged on purpose
+};
+
+void fwsim_init(int mains_hz, int error_ppm);
+void fwsim_run(int64_t now_us);
+void fwsim_transfer(const uint8_t *tx, uint8_t *rx, int len);
+void fwsim_stats_get(struct fwsim_stats *st);
+long fwsim_reply_crc_check(long count);
+
+// The same, for the firmware built with X10_DECODE
+void fwsim_decode_init(int mains_hz, int error_ppm);
+void fwsim_decode_run(int64_t now_us);
+void fwsim_decode_transfer(const uint8_t *tx, uint8_t *rx, int len);
+void fwsim_decode_stats_get(struct fwsim_stats *st);
+long fwsim_decode_reply_crc_check(long count);
+
+#endif /* fwsim_h */
@@ -0,0 +1,18 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * The simulator calls the interrupt handlers in between the passes of
+ * the main loop, so there is nothing to disable.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef sim_avr_interrupt_h
+#define sim_avr_interrupt_h
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif /* sim_avr_interrupt_h */
@@ -0,0 +1,62 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * ATtiny26 registers for the firmware simulator, see fwsim.c.
+ * They are plain variables, the simulator plays the hardware.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef sim_avr_io_h
+#define sim_avr_io_h
+
+#include <stdint.h>
+
+#define F_CPU 8000000UL
+
+extern volatile uint8_t DDRA, PORTA, PINA, DDRB, PORTB, PINB;
+extern volatile uint8_t USICR, USISR, USIDR;
+extern volatile uint8_t GIMSK, MCUCR, TIMSK, TIFR, SREG;
+extern volatile uint8_t TCCR0, TCNT0, TCCR1B, TCNT1, OCR1A, OCR1B;
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+// USICR, USISR
+#define USIOIE 6
+#define USIWM0 4
+#define USICS1 3
+#define USIOIF 6
+
+// GIMSK, MCUCR
+#define INT0 6
+#define PCIE0 4
+#define ISC00 0
+
+// TIMSK, TIFR
+#define OCIE1A 6
+#define OCIE1B 5
+#define OCF1A 6
+#define OCF1B 5
+
+// TCCR0, TCCR1B
+#define PSR0 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+#endif /* sim_avr_io_h */
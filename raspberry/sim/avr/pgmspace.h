@@ -0,0 +1,19 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Program memory of the firmware simulator is the ordinary one.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef sim_avr_pgmspace_h
+#define sim_avr_pgmspace_h
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#endif /* sim_avr_pgmspace_h */
@@ -0,0 +1,24 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * CRC-CCITT step of avr-libc, for the firmware simulator.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef sim_util_crc16_h
+#define sim_util_crc16_h
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+
+	return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+		^ ((uint16_t)data << 3));
+}
+
+#endif /* sim_util_crc16_h */
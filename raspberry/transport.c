@@ -0,0 +1,189 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * SPI transports other than spidev, which lives with its options in
+ * x10-spi.c.
+ *
+ * The simulator socket carries every segment as its length octet and
+ * the octets clocked out; the server answers with the octets clocked
+ * in. Segments run one at a time, the module is done with them at once.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transport.h"
+#include "fwsim.h"
+
+/*
+ * The simulator runs in this process. fwsim_init() must be called first.
+ */
+
+static int fwsim_open(const char *device)
+{
+	return -1;
+}
+
+static void fwsim_transfer_chain(int fd, const struct spi_segment *seg, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fwsim_run(monotonic_us());
+		fwsim_transfer(seg[i].tx, seg[i].rx, seg[i].len);
+	}
+}
+
+static void fwsim_close(int fd)
+{
+}
+
+const struct spi_transport fwsim_transport = {
+	"simulator", fwsim_open, fwsim_transfer_chain, fwsim_close
+};
+
+/*
+ * The same, with the firmware built with X10_DECODE.
+ * fwsim_decode_init() must be called first.
+ */
+
+static void fwsim_decode_transfer_chain(int fd, const struct spi_segment *seg,
+	int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fwsim_decode_run(monotonic_us());
+		fwsim_decode_transfer(seg[i].tx, seg[i].rx, seg[i].len);
+	}
+}
+
+const struct spi_transport fwsim_decode_transport = {
+	"decoding simulator", fwsim_open, fwsim_decode_transfer_chain,
+	fwsim_close
+};
+
+static int spi_socket_address(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path))
+		fail("Socket path is too long");
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static int spi_socket_io(int fd, void *buf, int len, int out)
+{
+	int ret, done = 0;
+
+	while (done < len) {
+		if (out)
+			ret = write(fd, (uint8_t *)buf + done, len - done);
+		else
+			ret = read(fd, (uint8_t *)buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+/*
+ * A simulator served by another process, see spi_transport_serve()
+ */
+
+static int spi_socket_open(const char *device)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = spi_socket_address(device + strlen(SPI_SOCKET_PREFIX), &addr);
+	if (fd < 0)
+		pabort("can't create socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		pabort("can't connect to the simulator");
+	signal(SIGPIPE, SIG_IGN);
+	return fd;
+}
+
+static void spi_socket_transfer(int fd, const struct spi_segment *seg, int n)
+{
+	uint8_t buf[256];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (seg[i].len >= sizeof(buf))
+			fail("Segment is too long for the simulator socket");
+		buf[0] = seg[i].len;
+		memcpy(buf + 1, seg[i].tx, seg[i].len);
+		if (spi_socket_io(fd, buf, seg[i].len + 1, 1) < 0
+			|| spi_socket_io(fd, seg[i].rx, seg[i].len, 0) < 0)
+			fail("Simulator has gone");
+	}
+}
+
+static void spi_socket_close(int fd)
+{
+	close(fd);
+}
+
+const struct spi_transport spi_socket_transport = {
+	"socket", spi_socket_open, spi_socket_transfer, spi_socket_close
+};
+
+const struct spi_transport *spi_transport_find(const char *device)
+{
+	if (strncmp(device, SPI_SOCKET_PREFIX, strlen(SPI_SOCKET_PREFIX)) == 0)
+		return &spi_socket_transport;
+	return &spidev_transport;
+}
+
+/*
+ * Serve the simulator on a Unix socket, one client at a time. This is
+ * an endless loop; fwsim_init() must be called first.
+ */
+
+void spi_transport_serve(const char *path)
+{
+	struct sockaddr_un addr;
+	uint8_t len, tx[255], rx[255];
+	int sock, fd;
+
+	sock = spi_socket_address(path, &addr);
+	if (sock < 0)
+		pabort("can't create socket");
+	// Remove stale socket left by previous instance
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		pabort("can't bind socket");
+	if (listen(sock, 1) < 0)
+		pabort("can't listen on socket");
+	signal(SIGPIPE, SIG_IGN);
+	plog(0, "Serving the simulator on %s\n", path);
+
+	while (1) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			plog(0, "Cannot accept client: %s\n", strerror(errno));
+			continue;
+		}
+		plog(1, "Client %d connected\n", fd);
+		while (spi_socket_io(fd, &len, 1, 0) == 0
+			&& spi_socket_io(fd, tx, len, 0) == 0) {
+			fwsim_run(monotonic_us());
+			fwsim_transfer(tx, rx, len);
+			if (spi_socket_io(fd, rx, len, 1) < 0)
+				break;
+		}
+		plog(1, "Client %d disconnected\n", fd);
+		close(fd);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * SPI transports: the spidev driver, the firmware simulator in process
+ * and the simulator served on a Unix socket.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef transport_h
+#define transport_h
+
+#include "x10-spi.h"
+
+// Devices named so are reached through spi_socket_transport
+#define SPI_SOCKET_PREFIX "unix:"
+
+struct spi_transport {
+	const char *name;
+	int (*open)(const char *device);	// returns the fd, aborts on error
+	// Runs the segments in order, CS is released after each one
+	void (*transfer)(int fd, const struct spi_segment *seg, int n);
+	void (*close)(int fd);
+};
+
+extern const struct spi_transport spidev_transport;
+extern const struct spi_transport fwsim_transport;
+extern const struct spi_transport fwsim_decode_transport;
+extern const struct spi_transport spi_socket_transport;
+
+const struct spi_transport *spi_transport_find(const char *device);
+void spi_transport_serve(const char *path);
+
+#endif /* transport_h */
@@ -0,0 +1,366 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Transmit queue.
+ *
+ * The module holds one request in transmission and accepts one more
+ * TRANSMIT request as postponed, answering RESPONSE_SEEN. A postponed
+ * request is started right after the current one is over, without any
+ * gap on the powerline. The queue hands the next message to the module
+ * as soon as the postponed slot becomes free, so a sequence of messages
+ * is transmitted as a seamless chain.
+ *
+ * A module with a transmit queue takes several SEND requests at once,
+ * up to the number of its slots, and lists their state in the QUEUE
+ * reply. Then the queue keeps that many messages handed over.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#include "txqueue.h"
+
+static struct x10_txq_msg *txq_msg(struct x10_tx_queue *q, int i)
+{
+	return &q->msgs[(q->head + i) % X10_TXQ_MESSAGES];
+}
+
+static void txq_report(struct x10_tx_queue *q, struct x10_txq_msg *m)
+{
+	if (m->reported)
+		return;
+	m->reported = 1;
+	plog(1, "Queued message %d is %s\n", m->msg.rr_id,
+		m->ret ? "done" : "failed");
+	if (q->report && m->owner)
+		q->report(m->owner, m->ret, m->ncmds);
+}
+
+/*
+ * Remove the first message from the queue, reporting it if needed.
+ */
+
+static void txq_retire(struct x10_tx_queue *q)
+{
+	struct x10_txq_msg *m = txq_msg(q, 0);
+
+	if (m->code == SPI_RESPONSE_COMPLETE)
+		x10_prediction_record(m->due_us, monotonic_us());
+	txq_report(q, m);
+	q->head = (q->head + 1) % X10_TXQ_MESSAGES;
+	q->count--;
+	if (q->submitted)
+		q->submitted--;
+}
+
+/*
+ * The link is broken: report every message as failed.
+ */
+
+static void txq_drop_all(struct x10_tx_queue *q)
+{
+	int i;
+
+	for (i = 0; i < q->count; i++)
+		if (!txq_msg(q, i)->reported)
+			txq_msg(q, i)->ret = 0;
+	while (q->count)
+		txq_retire(q);
+}
+
+/*
+ * Update the response code of the message. Completion is predicted
+ * when the transmission is seen to start.
+ */
+
+static void txq_set_code(struct x10_txq_msg *m, int code)
+{
+	if (m->code < SPI_RESPONSE_INPROGRESS
+		&& code == SPI_RESPONSE_INPROGRESS && m->due_us == 0)
+		m->due_us = x10_predict_completion(monotonic_us(),
+			spi_message_bits(&m->msg));
+	m->code = code;
+}
+
+/*
+ * The messages are transmitted in order: the first n are over.
+ */
+
+static void txq_retire_first(struct x10_tx_queue *q, int n)
+{
+	while (n--) {
+		txq_msg(q, 0)->code = SPI_RESPONSE_COMPLETE;
+		txq_retire(q);
+	}
+}
+
+static void txq_lost_track(struct x10_tx_queue *q)
+{
+	plog(0, "Strange thing has happened, wrong rr_id received\n");
+	while (q->submitted)
+		txq_retire(q);
+}
+
+static void txq_report_reached(struct x10_tx_queue *q)
+{
+	struct x10_txq_msg *m;
+	int i;
+
+	for (i = 0; i < q->submitted; i++) {
+		m = txq_msg(q, i);
+		if (m->code >= m->target)
+			txq_report(q, m);
+	}
+}
+
+/*
+ * Account for the module state found by the poll. The reply is about
+ * the last request the module has taken.
+ */
+
+static void txq_update(struct x10_tx_queue *q, const struct spi_message *rx)
+{
+	int k;
+
+	for (k = q->submitted - 1; k >= 0; k--)
+		if (txq_msg(q, k)->msg.rr_id == rx->rr_id)
+			break;
+	if (k < 0) {
+		txq_lost_track(q);
+		return;
+	}
+
+	txq_set_code(txq_msg(q, k), rx->rr_code);
+	// It has started, so the ones before it are over
+	if (rx->rr_code >= SPI_RESPONSE_INPROGRESS)
+		txq_retire_first(q, k);
+
+	if (q->submitted == 1 && txq_msg(q, 0)->code == SPI_RESPONSE_COMPLETE)
+		txq_retire(q);
+
+	txq_report_reached(q);
+}
+
+/*
+ * Account for the module queue found by the QUEUE poll. It holds the
+ * last messages handed over, those before them are over.
+ */
+
+static void txq_update_queue(struct x10_tx_queue *q,
+	const struct spi_queue_state *st)
+{
+	int i, k = q->submitted - st->count;
+
+	if (k < 0) {
+		txq_lost_track(q);
+		return;
+	}
+	for (i = 0; i < st->count; i++)
+		if (txq_msg(q, k + i)->msg.rr_id != st->rr_id[i]) {
+			txq_lost_track(q);
+			return;
+		}
+
+	txq_retire_first(q, k);
+	for (i = 0; i < st->count; i++)
+		txq_set_code(txq_msg(q, i), st->code[i]);
+
+	txq_report_reached(q);
+}
+
+/*
+ * Messages are handed over through the module queue, if it has one
+ * and they are SEND requests.
+ */
+
+static int txq_queued(struct x10_tx_queue *q)
+{
+	return q->slots > 0 && txq_msg(q, 0)->msg.rr_code == SPI_REQUEST_SEND;
+}
+
+/*
+ * Check if the module has a transmit queue. An old module takes the
+ * QUEUE request for a damaged one, dropping its postponed request, so
+ * this is only done while nothing is handed over.
+ */
+
+static void txq_probe(int fd, struct x10_tx_queue *q)
+{
+	struct spi_queue_state st;
+
+	st.slots = 0;
+	if (spi_queue_receive(fd, &st) < 0 || st.slots <= 0) {
+		plog(1, "The module has no transmit queue\n");
+		q->slots = -1;
+		return;
+	}
+	plog(1, "The module queues %d commands\n", st.slots);
+	q->slots = st.slots;
+}
+
+/*
+ * Postponed slot is free when nothing is sent yet, or when the only
+ * message sent is in progress already. The queue of the module is free
+ * while it has fewer messages than slots.
+ */
+
+static int txq_slot_free(struct x10_tx_queue *q)
+{
+	if (q->submitted == 0)
+		return 1;
+	if (txq_queued(q))
+		return q->submitted < q->slots;
+	return q->submitted == 1
+		&& txq_msg(q, 0)->code >= SPI_RESPONSE_INPROGRESS;
+}
+
+void x10_txq_init(struct x10_tx_queue *q,
+	void (*report)(void *owner, int ret, int ncmds))
+{
+	memset(q, 0, sizeof(*q));
+	q->report = report;
+}
+
+/*
+ * Poll the module, retire finished messages and submit the next ones
+ * while the module can take them.
+ * Returns: number of messages not reported yet
+ */
+
+int x10_txq_pump(int fd, struct x10_tx_queue *q)
+{
+	struct spi_message rx;
+	struct spi_queue_state st;
+	struct x10_txq_msg *m;
+	int i, pending;
+
+	if (q->slots == 0 && q->submitted == 0 && q->count
+		&& txq_msg(q, 0)->msg.rr_code == SPI_REQUEST_SEND)
+		txq_probe(fd, q);
+
+	if (q->submitted > 0 && txq_queued(q)) {
+		st.slots = q->slots;
+		if (spi_queue_receive(fd, &st) < 0) {
+			txq_drop_all(q);
+			return 0;
+		}
+		txq_update_queue(q, &st);
+	} else if (q->submitted > 0) {
+		if (!checked_spi_receive(fd, &rx)) {
+			txq_drop_all(q);
+			return 0;
+		}
+		txq_update(q, &rx);
+	}
+
+	while (q->submitted < q->count && txq_slot_free(q)) {
+		m = txq_msg(q, q->submitted);
+		m->ret = spi_send_request(fd, &m->msg, &rx);
+		if (!m->ret) {
+			txq_drop_all(q);
+			return 0;
+		}
+		q->submitted++;
+		// A postponed or queued message starts when the previous
+		// one is over
+		if (rx.rr_code == SPI_RESPONSE_SEEN && q->submitted >= 2
+			&& txq_msg(q, q->submitted - 2)->due_us)
+			m->due_us = txq_msg(q, q->submitted - 2)->due_us
+				+ x10_bits_us(spi_message_bits(&m->msg));
+		txq_update(q, &rx);
+	}
+
+	pending = 0;
+	for (i = 0; i < q->count; i++)
+		if (!txq_msg(q, i)->reported)
+			pending++;
+	return pending;
+}
+
+/*
+ * Time to wait before the next pump, based on the predicted completion
+ * of the message in transmission.
+ * Returns: delay in ms
+ */
+
+long x10_txq_delay(struct x10_tx_queue *q)
+{
+	if (q->submitted == 0)
+		return x10_completion_delay(0);
+	return x10_completion_delay(txq_msg(q, 0)->due_us);
+}
+
+/*
+ * Wait until every message in the queue is reported.
+ */
+
+void x10_txq_flush(int fd, struct x10_tx_queue *q)
+{
+	while (x10_txq_pump(fd, q) > 0)
+		sleep_ms(x10_txq_delay(q));
+}
+
+/*
+ * Encode the commands and put them to the queue, splitting them into
+ * as many chained messages as needed. Nothing is queued if the queue
+ * has no room for all of them; push again after a pump has retired
+ * some messages.
+ * Returns: 0 on success,
+ *			1 if the queue is too full now,
+ *			-1 if the commands cannot fit into the queue at all
+ */
+
+int x10_txq_push(int fd, struct x10_tx_queue *q, struct x10_command *cmds,
+	int count, int target, void *owner)
+{
+	struct spi_message msgs[X10_BATCH_MESSAGES];
+	int cmd_msg[X10_BATCH_COMMANDS];
+	struct x10_txq_msg *m;
+	int n_msgs, i, empty = 0;
+
+	if (count > X10_BATCH_COMMANDS)
+		return -1;
+	n_msgs = prepare_x10_batch(fd, msgs, X10_BATCH_MESSAGES, cmds, count,
+		cmd_msg);
+	if (n_msgs < 0 || n_msgs > X10_TXQ_MESSAGES)
+		return -1;
+
+	if (X10_TXQ_MESSAGES - q->count < n_msgs)
+		return 1;
+
+	for (i = 0; i < n_msgs; i++) {
+		m = txq_msg(q, q->count + i);
+		memset(m, 0, sizeof(*m));
+		m->msg = msgs[i];
+		m->owner = owner;
+		// Every message but the last one is only a part of the chain
+		m->target = (i == n_msgs - 1) ? target : SPI_RESPONSE_INPROGRESS;
+	}
+	// A command of no frames ahead of the others is done already
+	for (i = 0; i < count; i++)
+		if (cmd_msg[i] < 0)
+			empty++;
+		else
+			txq_msg(q, q->count + cmd_msg[i])->ncmds++;
+	q->count += n_msgs;
+	if (empty && q->report && owner)
+		q->report(owner, 1, empty);
+
+	// Start the transmission at once, if the module is free
+	x10_txq_pump(fd, q);
+
+	return 0;
+}
+
+/*
+ * The owner is gone, do not report to it anymore.
+ */
+
+void x10_txq_forget(struct x10_tx_queue *q, void *owner)
+{
+	int i;
+
+	for (i = 0; i < q->count; i++)
+		if (txq_msg(q, i)->owner == owner)
+			txq_msg(q, i)->owner = NULL;
+}
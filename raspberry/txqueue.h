@@ -0,0 +1,47 @@
+/*
+ * X10 control via SPI, Linux part of the picture.
+ *
+ * Transmit queue.
+ *
+ * Copyright (c) 2013 pavel@levshin.spb.ru
+ *
+ */
+
+#ifndef txqueue_h
+#define txqueue_h
+
+#include "x10-spi.h"
+
+#define X10_TXQ_MESSAGES 32
+
+struct x10_txq_msg {
+	struct spi_message msg;
+	int target;	// response code to reach before reporting
+	int ret;	// spi_send_request() result
+	int code;	// last response code seen for this message
+	int reported;
+	int ncmds;	// number of commands ending in this message
+	int64_t due_us;	// predicted completion, 0 if unknown
+	void *owner;
+};
+
+struct x10_tx_queue {
+	struct x10_txq_msg msgs[X10_TXQ_MESSAGES];
+	int head;
+	int count;
+	int submitted;	// messages handed to the module and not over
+	int slots;	// SEND commands the module queues, 0 if unknown,
+			// -1 if it has no queue
+	void (*report)(void *owner, int ret, int ncmds);
+};
+
+void x10_txq_init(struct x10_tx_queue *q,
+	void (*report)(void *owner, int ret, int ncmds));
+int x10_txq_push(int fd, struct x10_tx_queue *q, struct x10_command *cmds,
+	int count, int target, void *owner);
+int x10_txq_pump(int fd, struct x10_tx_queue *q);
+void x10_txq_flush(int fd, struct x10_tx_queue *q);
+long x10_txq_delay(struct x10_tx_queue *q);
+void x10_txq_forget(struct x10_tx_queue *q, void *owner);
+
+#endif /* txqueue_h */
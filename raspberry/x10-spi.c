@@ -18,6 +18,11 @@
 
 #include "x10-spi.h"
 #include "cm11.h"
+#include "daemon.h"
+#include "decoder.h"
+#include "fwsim.h"
+#include "transport.h"
+#include "txqueue.h"
 
 void fail(const char *s)
 {
@@ -42,14 +47,28 @@ void plog(int level, char *str, ...)
 		vfprintf(stderr, str, args);
 }
 
-static const char *device = "/dev/spidev0.0";
+static const char *devices[X10_MAX_DEVICES] = { "/dev/spidev0.0" };
+static int ndevices = 0;	// given with -D, the default is used if none
 static uint8_t mode;
 static uint8_t bits = 8;
 static uint32_t speed = 130000;
 static uint32_t rspeed = 0;
 static uint16_t delay;
+static const char *socket_path = X10_DAEMON_SOCKET;
 
 static int spi_trx_target = SPI_RESPONSE_INPROGRESS;
+static int mains_hz = 50;
+static int compact_send = 1;	// SEND requests, if the module takes them
+static int emulate = -1;	// octet error rate of the simulator, ppm
+static int cm11_ptys = 0;	// CM11 clients on pseudo-terminals
+
+/*
+ * The daemon drives every device from a thread of its own. The state of
+ * the link and of the receiver is kept per thread, so the functions
+ * below only ever see the device of the calling thread.
+ */
+
+static __thread const struct spi_transport *transport = &spidev_transport;
 
 #define lo8(a) ((uint16_t)a&0xFF)
 #define hi8(a) ((uint16_t)a >> 8)
@@ -65,7 +84,7 @@ static uint16_t crc_ccitt_update (uint16_t crc, uint8_t data)
 
 static uint16_t u16_reverse(uint16_t word)
 {
-	uint16_t tmp;
+	uint16_t tmp = 0;
 	uint8_t i;
 	for (i=16; i--;) {
 		tmp <<= 1;
@@ -76,15 +95,106 @@ static uint16_t u16_reverse(uint16_t word)
 	return tmp;
 }
 
+/*
+ * Table-driven CRC.
+ *
+ * crc_ccitt_update() and u16_reverse() above work bit by bit, and they
+ * are the reference. crc_tables[0] is the classic byte table; tables
+ * 1..7 advance the CRC over the following zero octets, so that 8 (or 4)
+ * octets are folded in at once ("slice-by-8"). The reverse of a 16-bit
+ * word is composed of two octet reverses.
+ */
+
+static uint16_t crc_tables[8][256];
+static uint8_t crc_reverse8[256];
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_tables(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc_tables[0][i] = crc_ccitt_update(0, i);
+		crc_reverse8[i] = u16_reverse(i) >> 8;
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_tables[k][i] = (crc_tables[k-1][i] >> 8)
+				^ crc_tables[0][crc_tables[k-1][i] & 0xff];
+}
+
+static uint16_t u16_reverse_table(uint16_t word)
+{
+	return (crc_reverse8[word & 0xff] << 8) | crc_reverse8[word >> 8];
+}
+
+static uint16_t crc_ccitt_table(uint16_t crc, const uint8_t *data, int len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crc_tables[0][(crc ^ *data++) & 0xff];
+	return crc;
+}
+
+static uint16_t crc_ccitt_block(uint16_t crc, const uint8_t *data, int len)
+{
+	pthread_once(&crc_tables_once, crc_init_tables);
+
+	for (; len >= 8; len -= 8, data += 8) {
+		crc ^= data[0] | (data[1] << 8);
+		crc = crc_tables[7][crc & 0xff] ^ crc_tables[6][crc >> 8]
+			^ crc_tables[5][data[2]] ^ crc_tables[4][data[3]]
+			^ crc_tables[3][data[4]] ^ crc_tables[2][data[5]]
+			^ crc_tables[1][data[6]] ^ crc_tables[0][data[7]];
+	}
+	if (len >= 4) {
+		crc ^= data[0] | (data[1] << 8);
+		crc = crc_tables[3][crc & 0xff] ^ crc_tables[2][crc >> 8]
+			^ crc_tables[1][data[2]] ^ crc_tables[0][data[3]];
+		len -= 4;
+		data += 4;
+	}
+	return crc_ccitt_table(crc, data, len);
+}
+
 static uint16_t spi_crc16(const struct spi_message *spi_buffer) 
 {
-	uint16_t crc = 0xffff;
-	int i;
+	uint16_t crc;
 
-	for (i=0; i<sizeof(*spi_buffer)-2; i++)
-		crc = crc_ccitt_update(crc, ((uint8_t*)spi_buffer)[i]);
+	crc = crc_ccitt_block(0xffff, (const uint8_t *)spi_buffer,
+		sizeof(*spi_buffer)-2);
 
-	return u16_reverse(crc);
+	return u16_reverse_table(crc);
+}
+
+static uint16_t spi_send_crc16(const struct spi_send *spi_buffer)
+{
+	return u16_reverse_table(crc_ccitt_block(0xffff,
+		(const uint8_t *)spi_buffer, sizeof(*spi_buffer)-2));
+}
+
+/*
+ * Checksum the request, whatever its layout.
+ */
+
+static void spi_seal(struct spi_message *msg)
+{
+	struct spi_send *send = (struct spi_send *)msg;
+
+	if (msg->rr_code == SPI_REQUEST_SEND)
+		send->crc16 = spi_send_crc16(send);
+	else
+		msg->crc16 = spi_crc16(msg);
+}
+
+/*
+ * Number of octets to clock for the request.
+ */
+
+static int spi_request_length(const struct spi_message *msg)
+{
+	if (msg->rr_code == SPI_REQUEST_SEND)
+		return sizeof(struct spi_send);
+	return sizeof(struct spi_message);
 }
 
 /*
@@ -168,12 +278,14 @@ const char *_x10_function[16] = {
 
 
 /*
- * Add basic code to existing bitstream.
+ * Add basic code to existing bitstream, bit by bit.
+ * This is the reference for the frame tables.
  * Returns: NULL if bitstream is full,
  *			bs on success
  */
 
-struct x10_bitstream* x10_basic( struct x10_bitstream* bs, uint8_t hc, uint8_t uc, uint8_t is_function )
+static struct x10_bitstream* x10_basic_bitwise( struct x10_bitstream* bs,
+	uint8_t hc, uint8_t uc, uint8_t is_function )
 {
 	short bs_tail = bs->tail;
 	uint16_t tmp;
@@ -231,13 +343,14 @@ struct x10_bitstream* x10_basic( struct x10_bitstream* bs, uint8_t hc, uint8_t u
 }
 
 /*
- * Add two extended bytes to existing bitstream.
+ * Add two extended bytes to existing bitstream, bit by bit.
+ * This is the reference for the frame tables.
  * Returns: NULL if bitstream is full,
  *			bs on success
  */
 
-struct x10_bitstream* x10_extended_code( struct x10_bitstream* bs, uint8_t uc, 
-	uint8_t byte1, uint8_t byte2 )
+static struct x10_bitstream* x10_extended_code_bitwise(
+	struct x10_bitstream* bs, uint8_t uc, uint8_t byte1, uint8_t byte2 )
 {
 	short bs_tail = bs->tail;
 	uint16_t tmp;
@@ -271,6 +384,110 @@ struct x10_bitstream* x10_extended_code( struct x10_bitstream* bs, uint8_t uc,
 	return bs;
 }
 
+/*
+ * Table-driven frame encoder.
+ *
+ * There are only 16*16*2 basic frames, and the extended code is just
+ * Manchester code of the unit code and two bytes. The frames are encoded
+ * once by the bitwise functions above, and spliced into the bitstream
+ * as a whole.
+ */
+
+static uint32_t x10_basic_frames[2][16][16];	// 22 bits each
+static uint16_t x10_manchester[256];		// 16 bits per byte
+static pthread_once_t x10_frames_once = PTHREAD_ONCE_INIT;
+
+static uint64_t x10_bits(const struct x10_bitstream *bs, int from, int n)
+{
+	uint64_t bits = 0;
+	int i;
+
+	for (i = from; i < from + n; i++)
+		bits = (bits << 1) | ((bs->data[i/8] >> (7 - i%8)) & 1);
+	return bits;
+}
+
+static void x10_frame_tables(void)
+{
+	struct x10_bitstream bs;
+	int f, hc, uc, i, j;
+
+	for (f = 0; f < 2; f++)
+		for (hc = 0; hc < 16; hc++)
+			for (uc = 0; uc < 16; uc++) {
+				memset(&bs, 0, sizeof(bs));
+				x10_basic_bitwise(&bs, hc, uc, f);
+				x10_basic_frames[f][hc][uc] = x10_bits(&bs, 0, 22);
+			}
+
+	for (i = 0; i < 256; i++) {
+		x10_manchester[i] = 0;
+		for (j = 7; j >= 0; j--)
+			x10_manchester[i] = (x10_manchester[i] << 2)
+				| (((i >> j) & 1) ? 0b10 : 0b01);
+	}
+}
+
+/*
+ * Append n bits (n <= 56) to the bitstream at any bit offset.
+ * The bits after the stream in its last octet are cleared.
+ * Returns: NULL if bitstream is full,
+ *			bs on success
+ */
+
+static struct x10_bitstream* x10_splice( struct x10_bitstream* bs,
+	uint64_t bits, int n )
+{
+	short dst_index = bs->tail / 8;
+	short dst_shift = bs->tail % 8;
+	short octets = (dst_shift + n + 7) / 8;
+	uint64_t tmp;
+
+	if (bs->tail + n > X10_BITSTREAM_OCTETS*8)
+		return NULL;
+
+	// meaningful bits of the first octet, then the new ones
+	tmp = bs->data[dst_index] >> (8 - dst_shift);
+	tmp = (tmp << n) | bits;
+	tmp <<= octets*8 - dst_shift - n;
+
+	while (octets--) {
+		bs->data[dst_index + octets] = tmp & 0xff;
+		tmp >>= 8;
+	}
+
+	bs->tail += n;
+
+	return bs;
+}
+
+/*
+ * Add basic code to existing bitstream.
+ * Returns: NULL if bitstream is full,
+ *			bs on success
+ */
+
+struct x10_bitstream* x10_basic( struct x10_bitstream* bs, uint8_t hc, uint8_t uc, uint8_t is_function )
+{
+	pthread_once(&x10_frames_once, x10_frame_tables);
+	return x10_splice(bs, x10_basic_frames[is_function ? 1 : 0][hc][uc], 22);
+}
+
+/*
+ * Add two extended bytes to existing bitstream.
+ * Returns: NULL if bitstream is full,
+ *			bs on success
+ */
+
+struct x10_bitstream* x10_extended_code( struct x10_bitstream* bs, uint8_t uc, 
+	uint8_t byte1, uint8_t byte2 )
+{
+	pthread_once(&x10_frames_once, x10_frame_tables);
+	return x10_splice(bs, ((uint64_t)(x10_manchester[_x10_code[uc]] & 0xff)
+		<< 32) | ((uint32_t)x10_manchester[byte1] << 16)
+		| x10_manchester[byte2], 40);
+}
+
 /*
  * Add pause to existing bitstream.
  * Returns: NULL if bitstream is full,
@@ -302,6 +519,20 @@ struct x10_bitstream* x10_pause( struct x10_bitstream* bs, unsigned short bits )
 	return bs;
 }
 
+static void log_spi_send(int level, const struct spi_send *send)
+{
+	fprintf(stderr, "= SPI SEND request %s=================\n",
+		send->crc16 != spi_send_crc16(send) ? "CRC ERROR " : "==========");
+	fprintf(stderr, "rr id   = %hhu\n", send->rr_id);
+	fprintf(stderr, "code    = %.2X, function = %.2X\n", send->code,
+		send->function);
+	fprintf(stderr, "repeats = %hhu/%hhu\n", send->addr_rpt,
+		send->func_rpt);
+	fprintf(stderr, "x bytes = %.2X %.2X\n", send->x_byte_1,
+		send->x_byte_2);
+	fprintf(stderr, "= SPI message end ==============================\n");
+}
+
 void log_spi_message(int level, const struct spi_message *msg)
 {
 	int j;
@@ -309,6 +540,11 @@ void log_spi_message(int level, const struct spi_message *msg)
 	if (level > verbosity)
 		return;
 
+	if (msg->rr_code == SPI_REQUEST_SEND) {
+		log_spi_send(level, (const struct spi_send *)msg);
+		return;
+	}
+
 	if (msg->crc16 != spi_crc16(msg))
 		fprintf(stderr, "= SPI message CRC ERROR ========================\n");
 	else
@@ -323,6 +559,7 @@ void log_spi_message(int level, const struct spi_message *msg)
 			fprintf(stderr, "\n");
 	}
 	fprintf(stderr, "tail    = %hhu\n", msg->x10_data.tail);
+	fprintf(stderr, "rx seq  = %hu\n", msg->rx_seq);
 	fprintf(stderr, "crc     = %.4X/%.4X\n", msg->crc16, spi_crc16(msg));
 	fprintf(stderr, "hex dump:\n");
         for (j = 0; j < sizeof(*msg); j++) {
@@ -334,27 +571,210 @@ void log_spi_message(int level, const struct spi_message *msg)
 	fprintf(stderr, "= SPI message end ==============================\n");
 }
 
-static void spi_transfer(int fd, const struct spi_message *spi_tx_msg,
-	struct spi_message *spi_rx_msg)
+/*
+ * Run a chain of SPI messages in a single ioctl. CS is released after
+ * every segment, so the module takes each one as a separate message.
+ *
+ * spidev keeps CS asserted during delay_usecs, and the module does not
+ * process a message until CS is released. So the wait_us of a segment
+ * is a zero-length transfer after CS is toggled; the module updates the
+ * first octet of its answer while CS is held idle.
+ */
+
+static void spidev_transfer(int fd, const struct spi_segment *seg, int n)
 {
+	struct spi_ioc_transfer tr[SPI_MAX_SEGMENTS*2];
+	int i, count = 0;
 	int ret;
 
-	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)spi_tx_msg,
-		.rx_buf = (unsigned long)spi_rx_msg,
-		.len = sizeof(struct spi_message),
-		.delay_usecs = delay,
-		.speed_hz = speed,
-		.bits_per_word = bits,
-	};
+	memset(tr, 0, sizeof(tr));
+	for (i = 0; i < n; i++) {
+		tr[count].tx_buf = (unsigned long)seg[i].tx;
+		tr[count].rx_buf = (unsigned long)seg[i].rx;
+		tr[count].len = seg[i].len;
+		tr[count].delay_usecs = delay;
+		tr[count].speed_hz = speed;
+		tr[count].bits_per_word = bits;
+		if (i == n - 1)
+			break;
+		tr[count++].cs_change = 1;
+		if (seg[i].wait_us) {
+			tr[count].delay_usecs = seg[i].wait_us;
+			tr[count].speed_hz = speed;
+			tr[count++].bits_per_word = bits;
+		}
+	}
+	count++;
+
+	ret = ioctl(fd, SPI_IOC_MESSAGE(count), tr);
+	if (ret < 1)
+		pabort("can't send spi message");
+
+}
+
+static int spidev_open(const char *device)
+{
+	int ret = 0;
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		pabort("can't open device");
+
+	/*
+	 * spi mode
+	 */
+	ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
+	if (ret == -1)
+		pabort("can't set spi mode");
+
+	ret = ioctl(fd, SPI_IOC_RD_MODE, &mode);
+	if (ret == -1)
+		pabort("can't get spi mode");
+
+	/*
+	 * bits per word
+	 */
+	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+	if (ret == -1)
+		pabort("can't set bits per word");
+
+	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
+	if (ret == -1)
+		pabort("can't get bits per word");
+
+	/*
+	 * max speed hz
+	 */
+	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+	if (ret == -1)
+		pabort("can't set max speed hz");
+
+	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &rspeed);
+	if (ret == -1)
+		pabort("can't get max speed hz");
+	plog(2, "spi mode: %d\n", mode);
+	plog(2, "bits per word: %d\n", bits);
+	plog(2, "max speed: %d Hz (%d KHz)\n", rspeed, rspeed/1000);
+
+	return fd;
+}
+
+static void spidev_close(int fd)
+{
+	close(fd);
+}
+
+const struct spi_transport spidev_transport = {
+	"spidev", spidev_open, spidev_transfer, spidev_close
+};
+
+/*
+ * Open the device for the calling thread, with the transport it needs
+ */
+
+int x10_device_open(const char *device)
+{
+	transport = (emulate >= 0) ? &fwsim_transport
+		: spi_transport_find(device);
+	plog(1, "Using the %s transport for %s\n", transport->name, device);
+	return transport->open(device);
+}
+
+void x10_device_close(int fd)
+{
+	transport->close(fd);
+}
 
+/*
+ * All the traffic to the module goes through here
+ */
+
+static void spi_transfer_chain(int fd, const struct spi_segment *seg, int n)
+{
 	plog(1, "*");
 	plog(2, "****************** SPI transfer ********************\n");
 
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-	if (ret < 1)
-		pabort("can't send spi message");
+	transport->transfer(fd, seg, n);
+}
+
+static void spi_transfer_octets(int fd, const uint8_t *tx, uint8_t *rx,
+	int len)
+{
+	struct spi_segment seg = { tx, rx, len, 0 };
+
+	spi_transfer_chain(fd, &seg, 1);
+}
+
+static void spi_transfer(int fd, const struct spi_message *spi_tx_msg,
+	struct spi_message *spi_rx_msg)
+{
+	spi_transfer_octets(fd, (const uint8_t *)spi_tx_msg,
+		(uint8_t *)spi_rx_msg, sizeof(struct spi_message));
+}
+
+static __thread struct x10_link_stats link_stats;
+
+/*
+ * Check the CRC of a reply from the module, counting the errors.
+ */
+
+static int spi_reply_valid(const struct spi_message *msg)
+{
+	link_stats.replies++;
+	if (spi_crc16(msg) == msg->crc16)
+		return 1;
+	link_stats.crc_errors++;
+	return 0;
+}
+
+void x10_link_stats_get(struct x10_link_stats *st)
+{
+	*st = link_stats;
+}
+
+/*
+ * DELTA and COMMANDS requests: ask the module for the items after the
+ * given counter, up to max items of size octets each. The reply is
+ * as short as the host allows, see "SPI interface.txt".
+ * Returns: number of items in the reply,
+ *			-1 if the reply is damaged
+ */
+
+static int spi_short_receive(int fd, uint8_t code, uint8_t from, int max,
+	int size, uint8_t *reply)
+{
+	uint8_t request[sizeof(struct spi_message)];
+	int len = SPI_DELTA_HEADER + max * size + 2;
+	uint16_t crc = 0xffff;
+	int count;
+
+	memset(request, 0, len);
+	request[0] = code;
+	request[1] = from;
+	request[2] = max;
+	spi_transfer_octets(fd, request, reply, len);
+
+	count = reply[4];
+	if (count > max)
+		return -1;
+	len = SPI_DELTA_HEADER + count * size;
+	crc = crc_ccitt_block(crc, reply, len);
+	if (reply[len] != lo8(crc) || reply[len + 1] != hi8(crc))
+		return -1;
+	return count;
+}
+
+static int spi_delta_receive(int fd, uint8_t from, int max, uint8_t *reply)
+{
+	return spi_short_receive(fd, SPI_REQUEST_DELTA, from, max, 1, reply);
+}
 
+static int spi_commands_receive(int fd, uint8_t from, int max,
+	uint8_t *reply)
+{
+	return spi_short_receive(fd, SPI_REQUEST_COMMANDS, from, max,
+		SPI_RECORD_OCTETS, reply);
 }
 
 void log_command(int level, struct x10_command *p_cmd)
@@ -390,12 +810,19 @@ static int parse_decimal(char **ptr)
 	return x;
 }
 
-void parse_command(const char* orig_cmd, struct x10_command* p_cmd)
+/*
+ * Parse a textual command into p_cmd.
+ * Returns: NULL on success,
+ *			error message otherwise
+ */
+
+const char *parse_command(const char* orig_cmd, struct x10_command* p_cmd)
 {
 	char *cmd;
 	char *c_ptr, *c_ptr_e;
 	int x; // temporary number
 	int has_uc;
+	const char *err = NULL;
 
 	cmd = strdup( orig_cmd );
 	p_cmd->hc = p_cmd->uc = p_cmd->fc = -1;
@@ -413,7 +840,8 @@ void parse_command(const char* orig_cmd, struct x10_command* p_cmd)
 		if ( *c_ptr >= 'a' && *c_ptr <= 'p' ) {
 			p_cmd->hc = *c_ptr - 'a';
 		} else {
-			fail("X10 address should begin with HC");
+			err = "X10 address should begin with HC";
+			goto out;
 		}
 
 		x = has_uc = 0;
@@ -421,7 +849,8 @@ void parse_command(const char* orig_cmd, struct x10_command* p_cmd)
 			if ( isdigit(*c_ptr) ) {
 				x = x * 10 + *c_ptr - '0';
 			} else {
-				fail("X10 unit number should be a number");
+				err = "X10 unit number should be a number";
+				goto out;
 			}
 			has_uc = 1;
 		}
@@ -431,7 +860,8 @@ void parse_command(const char* orig_cmd, struct x10_command* p_cmd)
 				p_cmd->uc = x;
 				p_cmd->addr_rpt = 2;
 			} else {
-				fail("Unit code out of bounds [1..16]");
+				err = "Unit code out of bounds [1..16]";
+				goto out;
 			}
 		}
 		++c_ptr;
@@ -474,139 +904,514 @@ void parse_command(const char* orig_cmd, struct x10_command* p_cmd)
 		} else if (strncmp(c_ptr, "xpreset[", 8) == 0) {
 			c_ptr += 8;
 			x = parse_decimal(&c_ptr);
-			if ( x<0 || x>63 )
-				fail("Xpreset value not in range [0..63]");
-			if (strcmp(c_ptr, "]") != 0)
-				fail("Xpreset command malformed");
+			if ( x<0 || x>63 ) {
+				err = "Xpreset value not in range [0..63]";
+				goto out;
+			}
+			if (strcmp(c_ptr, "]") != 0) {
+				err = "Xpreset command malformed";
+				goto out;
+			}
 			p_cmd->fc = X10_FUNC_EXTENDEDCODE;
 			p_cmd->x_byte_2 = 0x31; // XPreset code
 			p_cmd->x_byte_1 = x; // XPreset code
 			p_cmd->addr_rpt = 0; // no need to address
 		} else {
-			fail("Command not understood");
+			err = "Command not understood";
+			goto out;
 		}
 	}
+	err = check_command(p_cmd);
+out:
 	free( cmd );
+	return err;
 }
 
-void prepare_x10_transmit(struct spi_message *msg, struct x10_command *p_cmd)
-{
-	int i;
-
-	log_command(1, p_cmd);
-
-	memset(msg, 0, sizeof(*msg));
-	msg->rr_code = SPI_REQUEST_TRANSMIT;
+/*
+ * Check that the command can be encoded for transmission.
+ * Returns: NULL if it can,
+ *			error message otherwise
+ */
 
+const char *check_command(const struct x10_command *p_cmd)
+{
 	if ( p_cmd->hc == -1 )
-	    fail("House code not set");
+		return "House code not set";
 
 	if ( p_cmd->uc == -1 && p_cmd->fc == -1 )
-	    fail("Unit code or a function need to be set");
-
-	for ( i = p_cmd->addr_rpt; i>0; --i )
-		if (!x10_basic(&msg->x10_data, p_cmd->hc, p_cmd->uc, 0))
-			fail("Failed to encode command");
-
-	if ( p_cmd->addr_rpt )
-		if (!x10_pause(&msg->x10_data, 6))
-			fail("Failed to encode command");
-
-	for ( i = p_cmd->func_rpt; i>0; --i )
-		if ( p_cmd->fc == X10_FUNC_EXTENDEDCODE ) {
-			if ( p_cmd->uc == -1 )
-				fail("Extended command needs unit code");
-			if (!x10_basic(&msg->x10_data, p_cmd->hc, p_cmd->fc, 1))
-				fail("Failed to encode command");
-			if (!x10_extended_code(&msg->x10_data, p_cmd->uc, p_cmd->x_byte_1, p_cmd->x_byte_2))
-				fail("Failed to encode command");
-		}
-		else {
-			if (!x10_basic(&msg->x10_data, p_cmd->hc, p_cmd->fc, 1))
-				fail("Failed to encode command");
-		}
-	if (p_cmd->func_rpt && !p_cmd->sticky)
-		if (!x10_pause(&msg->x10_data, 6))
-			fail("Failed to encode command");
+		return "Unit code or a function need to be set";
 
+	if ( p_cmd->func_rpt && p_cmd->fc == X10_FUNC_EXTENDEDCODE
+		&& p_cmd->uc == -1 )
+		return "Extended command needs unit code";
+
+	return NULL;
 }
 
-#define MAX_SPI_TRIES 10
+/*
+ * Append a single frame (or pause) to the last message of the batch.
+ * A new message is started when the frame does not fit.
+ * Returns: 0 on success,
+ *			-1 if there is no room for a new message
+ */
 
-int checked_spi_receive(int fd, struct spi_message *spi_rx_msg)
+static int x10_batch_frame(struct spi_message *msgs, int max_msgs,
+	int *n_msgs, const struct x10_bitstream *frame)
 {
-	int try;
-	struct spi_message spi_poll_message;
+	struct spi_message *msg;
 
-	memset(&spi_poll_message, 0, sizeof(spi_poll_message));
-	for (try=MAX_SPI_TRIES; try>0; --try)
-	{
-		spi_transfer(fd, &spi_poll_message, spi_rx_msg);
-		if (spi_crc16(spi_rx_msg) == spi_rx_msg->crc16 ) {
-			break;
-		}
-		plog(1, "<<< Incoming message CRC ERROR <<<\n");
+	if (*n_msgs > 0 && x10concat(&msgs[*n_msgs - 1].x10_data, frame))
+		return 0;
+
+	if (*n_msgs == max_msgs)
+		return -1;
+
+	msg = &msgs[(*n_msgs)++];
+	memset(msg, 0, sizeof(*msg));
+	msg->rr_code = SPI_REQUEST_TRANSMIT;
+	x10concat(&msg->x10_data, frame);
+
+	return 0;
+}
+
+/*
+ * Append all frames of the command to the batch, frame by frame.
+ * Returns: 0 on success,
+ *			-1 if the batch is full
+ */
+
+static int x10_batch_command(struct spi_message *msgs, int max_msgs,
+	int *n_msgs, const struct x10_command *p_cmd)
+{
+	struct x10_bitstream frame;
+	int i;
+
+	for ( i = p_cmd->addr_rpt; i>0; --i ) {
+		memset(&frame, 0, sizeof(frame));
+		x10_basic(&frame, p_cmd->hc, p_cmd->uc, 0);
+		if (x10_batch_frame(msgs, max_msgs, n_msgs, &frame))
+			return -1;
+	}
+
+	if ( p_cmd->addr_rpt ) {
+		memset(&frame, 0, sizeof(frame));
+		x10_pause(&frame, 6);
+		if (x10_batch_frame(msgs, max_msgs, n_msgs, &frame))
+			return -1;
+	}
+
+	for ( i = p_cmd->func_rpt; i>0; --i ) {
+		memset(&frame, 0, sizeof(frame));
+		x10_basic(&frame, p_cmd->hc, p_cmd->fc, 1);
+		if ( p_cmd->fc == X10_FUNC_EXTENDEDCODE )
+			x10_extended_code(&frame, p_cmd->uc, p_cmd->x_byte_1,
+				p_cmd->x_byte_2);
+		if (x10_batch_frame(msgs, max_msgs, n_msgs, &frame))
+			return -1;
+	}
+
+	if (p_cmd->func_rpt && !p_cmd->sticky) {
+		memset(&frame, 0, sizeof(frame));
+		x10_pause(&frame, 6);
+		if (x10_batch_frame(msgs, max_msgs, n_msgs, &frame))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Encode the command as a SEND request, the module builds the frames.
+ */
+
+static void x10_send_prepare(struct spi_message *msg,
+	const struct x10_command *p_cmd)
+{
+	struct spi_send *send = (struct spi_send *)msg;
+
+	memset(msg, 0, sizeof(*msg));
+	send->rr_code = SPI_REQUEST_SEND;
+	send->code = _x10_code[p_cmd->hc] << 4;
+	if (p_cmd->uc >= 0)
+		send->code |= _x10_code[p_cmd->uc];
+	if (p_cmd->fc >= 0)
+		send->function = _x10_code[p_cmd->fc] << 4;
+	if (p_cmd->sticky)
+		send->function |= SPI_SEND_STICKY;
+	send->addr_rpt = p_cmd->addr_rpt;
+	send->func_rpt = p_cmd->func_rpt;
+	send->x_byte_1 = p_cmd->x_byte_1;
+	send->x_byte_2 = p_cmd->x_byte_2;
+}
+
+/*
+ * Length of the transmission requested, in bits.
+ */
+
+int spi_message_bits(const struct spi_message *msg)
+{
+	const struct spi_send *send = (const struct spi_send *)msg;
+	int frame = 22;
+	int bits;
+
+	if (msg->rr_code != SPI_REQUEST_SEND)
+		return msg->x10_data.tail;
+
+	if ((send->function >> 4) == _x10_code[X10_FUNC_EXTENDEDCODE])
+		frame += 40;
+	bits = send->addr_rpt * 22 + send->func_rpt * frame;
+	if (send->addr_rpt)
+		bits += 6;
+	if (send->func_rpt && !(send->function & SPI_SEND_STICKY))
+		bits += 6;
+	return bits;
+}
+
+static __thread int module_send;	// 1 takes SEND, -1 does not, 0 not known
+
+/*
+ * Ask the module to SEND a command of no frames. A module without SEND
+ * takes the short request for a damaged one, and never acknowledges it.
+ * Returns: 1 if the module takes SEND requests,
+ *			-1 otherwise
+ */
+
+static int spi_send_probe(int fd)
+{
+	struct spi_message msg, reply;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.rr_code = SPI_REQUEST_SEND;
+	if (spi_send_request(fd, &msg, &reply)) {
+		plog(1, "The module takes SEND requests\n");
+		return 1;
+	}
+	plog(0, "The module takes no SEND requests, sending bitstreams\n");
+	return -1;
+}
+
+/*
+ * Pack the commands into as few transmit messages as possible. Every
+ * bitstream gets as many complete frames and pauses as fit into it.
+ * With compact_send, every command is a SEND request of its own instead,
+ * unless the module turns out not to take them.
+ * If cmd_msg is not NULL, it receives the index of the message carrying
+ * the last frame of every command, -1 if a command of no frames comes
+ * before any message.
+ * Returns: number of messages used,
+ *			-1 if the commands do not fit into max_msgs
+ */
+
+int prepare_x10_batch(int fd, struct spi_message *msgs, int max_msgs,
+	struct x10_command *cmds, int count, int *cmd_msg)
+{
+	int i;
+	int n_msgs = 0;
+	const char *err;
+
+	if (compact_send && module_send == 0)
+		module_send = spi_send_probe(fd);
+
+	for (i = 0; i < count; i++) {
+		log_command(1, &cmds[i]);
+
+		err = check_command(&cmds[i]);
+		if (err)
+			fail(err);
+
+		if (compact_send && module_send > 0) {
+			if (n_msgs == max_msgs)
+				return -1;
+			x10_send_prepare(&msgs[n_msgs++], &cmds[i]);
+		} else if (x10_batch_command(msgs, max_msgs, &n_msgs, &cmds[i]))
+			return -1;
+		if (cmd_msg)
+			cmd_msg[i] = n_msgs - 1;
+	}
+
+	plog(1, "%d command(s) packed into %d message(s)\n", count, n_msgs);
+
+	return n_msgs;
+}
+
+/*
+ * Completion time model.
+ *
+ * X10 sends one bit per mains half-cycle, so the transmission time is
+ * known from the bitstream length. Instead of polling at a fixed rate,
+ * the host sleeps until shortly before the predicted completion and then
+ * polls tightly around it. Predicted and observed completion times are
+ * recorded, so the model can be checked.
+ */
+
+#define X10_POLL_SLOW 200	// ms, when no prediction is available
+#define X10_POLL_TIGHT 10	// ms, around the predicted completion
+#define X10_POLL_LATE 500	// ms after the prediction to give up on it
+
+static __thread struct x10_prediction_stats prediction_stats;
+
+int64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Time to transmit the given number of bits
+ */
+
+int64_t x10_bits_us(int bits)
+{
+	return bits * 500000LL / mains_hz;
+}
+
+/*
+ * Predict completion of a bitstream, which starts at the next zero
+ * crossing after start_us.
+ */
+
+int64_t x10_predict_completion(int64_t start_us, int bits)
+{
+	return start_us + x10_bits_us(bits + 1);
+}
+
+/*
+ * How long to sleep before the next poll, when waiting for
+ * a transmission predicted to complete at due_us (0 if unknown).
+ * Returns: delay in ms
+ */
+
+long x10_completion_delay(int64_t due_us)
+{
+	int64_t now = monotonic_us();
+	int64_t early = due_us - x10_bits_us(2);
+
+	if (due_us == 0 || now > due_us + X10_POLL_LATE * 1000LL)
+		return X10_POLL_SLOW;
+	if (now < early)
+		return (early - now + 999) / 1000;
+	return X10_POLL_TIGHT;
+}
+
+/*
+ * Record the completion observed at actual_us against the prediction.
+ */
+
+void x10_prediction_record(int64_t predicted_us, int64_t actual_us)
+{
+	struct x10_prediction_stats *st = &prediction_stats;
+	long error = actual_us - predicted_us;
+
+	if (predicted_us == 0)
+		return;
+	plog(1, "Completion predicted %+ld us off\n", error);
+	st->samples++;
+	st->sum_error_us += error;
+	if (error < st->max_early_us)
+		st->max_early_us = error;
+	if (error > st->max_late_us)
+		st->max_late_us = error;
+}
+
+void x10_prediction_get(struct x10_prediction_stats *st)
+{
+	*st = prediction_stats;
+}
+
+void x10_prediction_log(int level)
+{
+	struct x10_prediction_stats *st = &prediction_stats;
+
+	if (!st->samples)
+		return;
+	plog(level, "Completion predictions: %d, mean error %lld us, "
+		"earliest %ld us, latest %+ld us\n", st->samples,
+		st->sum_error_us / st->samples, st->max_early_us,
+		st->max_late_us);
+}
+
+void sleep_ms(long ms)
+{
+	struct timespec ts_rq;
+
+	ts_rq.tv_sec = ms / 1000;
+	ts_rq.tv_nsec = (ms % 1000) * 1000000L;
+	while(nanosleep(&ts_rq, &ts_rq));
+}
+
+#define MAX_SPI_TRIES 10
+#define SPI_PROCESSING_US 1000	// time for the module to take a request
+
+static __thread int spi_rr_id = -1;	// last rr_id seen, -1 if unknown
+
+int checked_spi_receive(int fd, struct spi_message *spi_rx_msg)
+{
+	int try;
+	struct spi_message spi_poll_message;
+
+	memset(&spi_poll_message, 0, sizeof(spi_poll_message));
+	for (try=MAX_SPI_TRIES; try>0; --try)
+	{
+		spi_transfer(fd, &spi_poll_message, spi_rx_msg);
+		if (spi_reply_valid(spi_rx_msg)) {
+			break;
+		}
+		plog(1, "<<< Incoming message CRC ERROR <<<\n");
 		log_spi_message(2, spi_rx_msg);
 	}
 	if ( try > 0 )
 	{
 		plog(2, "<<< Incoming message <<<\n");
 		log_spi_message(2, spi_rx_msg);
+		spi_rr_id = spi_rx_msg->rr_id;
 	}
 	return try;
 }
 
-int reliable_spi_transfer(int fd, struct spi_message *spi_tx_msg,
-	struct spi_message *spi_rx_msg, int target_code )
+/*
+ * Read the transmit queue of the module. A module without the queue
+ * takes the request for a damaged one, so no reply passes the check.
+ * Until st->slots is known, this is a probe: it gives up sooner, and
+ * its failures are not counted as link errors.
+ * Returns: number of queued commands, -1 if there is no valid reply
+ */
+
+int spi_queue_receive(int fd, struct spi_queue_state *st)
+{
+	uint8_t reply[sizeof(struct spi_message)];
+	int probe = st->slots <= 0;
+	int try, count, i;
+
+	for (try = probe ? 3 : MAX_SPI_TRIES; try > 0; --try) {
+		count = spi_short_receive(fd, SPI_REQUEST_QUEUE, 0,
+			SPI_QUEUE_MAX, SPI_QUEUE_ENTRY_OCTETS, reply);
+		if (!probe)
+			link_stats.replies++;
+		if (count >= 0)
+			break;
+		if (!probe) {
+			plog(1, "<<< QUEUE reply CRC ERROR <<<\n");
+			link_stats.crc_errors++;
+		}
+	}
+	if (try == 0)
+		return -1;
+
+	st->slots = reply[2];
+	st->free = reply[3];
+	st->count = count;
+	for (i = 0; i < count; i++) {
+		st->rr_id[i] = reply[SPI_QUEUE_HEADER + i * 2];
+		st->code[i] = reply[SPI_QUEUE_HEADER + i * 2 + 1];
+	}
+	plog(2, "<<< Module queue: %d of %d slots used <<<\n",
+		count, st->slots);
+	return count;
+}
+
+/*
+ * Deliver the request to the module and wait until it is acknowledged.
+ * Every try is a single chain: the request itself, then a poll after
+ * the module has had time to process it. The answer to the request
+ * tells the module state before it, like a separate poll would.
+ * The rr_id to use is the next one after the last rr_id seen; only
+ * if nothing is known yet, the module is polled first.
+ * Returns: number of tries left,
+ *			0 on failure
+ */
+
+int spi_send_request(int fd, struct spi_message *spi_tx_msg,
+	struct spi_message *spi_rx_msg)
 {
 	int try;
-	struct spi_message spi_poll_message;
-	struct timespec ts_rq;
+	struct spi_message spi_poll_message, spi_before_msg;
+	struct spi_segment seg[2] = {
+		{ spi_tx_msg, &spi_before_msg, spi_request_length(spi_tx_msg),
+			SPI_PROCESSING_US },
+		{ &spi_poll_message, spi_rx_msg, sizeof(struct spi_message), 0 },
+	};
 
-	memset(&spi_poll_message, 0, sizeof(spi_poll_message));
-	// Just poll and receive rr_id
-	try = checked_spi_receive(fd, spi_rx_msg);
+	if (spi_rr_id < 0) {
+		// Just poll and receive rr_id
+		try = checked_spi_receive(fd, spi_rx_msg);
 
-	if (try < MAX_SPI_TRIES)
-		plog(1, "Warning: %d poll tries have failed\n", MAX_SPI_TRIES - try);
+		if (try < MAX_SPI_TRIES)
+			plog(1, "Warning: %d poll tries have failed\n",
+				MAX_SPI_TRIES - try);
 
-	if (try == 0 || spi_tx_msg == NULL)
-		return try;
+		if (try == 0)
+			return 0;
+	}
 
-	// Use the rr_id we just received
-	spi_tx_msg->rr_id = (spi_rx_msg->rr_id+1) % 256;
-	spi_tx_msg->crc16 = spi_crc16(spi_tx_msg);
+	memset(&spi_poll_message, 0, sizeof(spi_poll_message));
+	spi_tx_msg->rr_id = (spi_rr_id+1) % 256;
+	spi_seal(spi_tx_msg);
 
 	for (try = MAX_SPI_TRIES+1; try>0; --try)
 	{
 		plog(2, ">>> Outgoing message >>>\n");
 		log_spi_message(2, spi_tx_msg);
-		spi_transfer(fd, spi_tx_msg, spi_rx_msg);
+		spi_transfer_chain(fd, seg, 2);
 		plog(2, "<<< Incoming message <<<\n");
 		log_spi_message(2, spi_rx_msg);
 
+		// Someone else has used this rr_id, so the request was ignored.
+		// The answer to a short request has no CRC, so rr_id is
+		// trusted as is: a false alarm only costs a retry.
+		if ((seg[0].len < sizeof(struct spi_message)
+			|| spi_reply_valid(&spi_before_msg))
+			&& spi_before_msg.rr_id == spi_tx_msg->rr_id
+			&& try == MAX_SPI_TRIES+1) {
+			plog(1, "Warning: rr_id %d is in use already\n",
+				spi_tx_msg->rr_id);
+			spi_tx_msg->rr_id = (spi_tx_msg->rr_id+1) % 256;
+			spi_seal(spi_tx_msg);
+			continue;
+		}
+
 		// Check if rr_id is known to Tiny now
-		if (spi_crc16(spi_rx_msg) == spi_rx_msg->crc16 
+		if (spi_reply_valid(spi_rx_msg)
 			&& spi_rx_msg->rr_id == spi_tx_msg->rr_id) {
+			spi_rr_id = spi_rx_msg->rr_id;
 			break;
 		}
-
-		ts_rq.tv_sec = 0;
-		ts_rq.tv_nsec = 1000000L; // Allow 1 ms for processing
-		while(nanosleep(&ts_rq, &ts_rq));
 	}
 
 	if (try < MAX_SPI_TRIES) {
 		plog(1, "Warning: %d trx tries have failed\n", MAX_SPI_TRIES - try);
 	}
 
+	return try;
+}
+
+int reliable_spi_transfer(int fd, struct spi_message *spi_tx_msg,
+	struct spi_message *spi_rx_msg, int target_code )
+{
+	int try;
+	int64_t due = 0;
+
+	if (spi_tx_msg == NULL) {
+		// Just poll
+		try = checked_spi_receive(fd, spi_rx_msg);
+		if (try < MAX_SPI_TRIES)
+			plog(1, "Warning: %d poll tries have failed\n",
+				MAX_SPI_TRIES - try);
+		return try;
+	}
+
+	try = spi_send_request(fd, spi_tx_msg, spi_rx_msg);
 	if ( try == 0 )
 		return 0;
 
+	// A postponed request waits for an unknown transmission
+	if (spi_rx_msg->rr_code == SPI_RESPONSE_INPROGRESS)
+		due = x10_predict_completion(monotonic_us(),
+			spi_message_bits(spi_tx_msg));
+
 	while ( spi_rx_msg->rr_code < target_code ) {
-		ts_rq.tv_sec = 0;
-		ts_rq.tv_nsec = 200000000L; // Allow 200 ms for processing
-		while(nanosleep(&ts_rq, &ts_rq));
+		sleep_ms(x10_completion_delay(due));
 		// Poll now
 		try = checked_spi_receive(fd, spi_rx_msg);
 		if (try == 0)
@@ -616,201 +1421,419 @@ int reliable_spi_transfer(int fd, struct spi_message *spi_tx_msg,
 			plog(0, "Strange thing has happened, wrong rr_id received");
 			break;
 		}
+		if (spi_rx_msg->rr_code == SPI_RESPONSE_COMPLETE)
+			x10_prediction_record(due, monotonic_us());
 	}
 
 	return try;
 }
 
+/*
+ * Transmit the commands, packed into as few SPI transactions as possible
+ * and chained through the transmit queue.
+ * results[i] receives the result for the message carrying the last frame
+ * of command i.
+ */
+
+static void batch_x10_report(void *owner, int ret, int ncmds)
+{
+	int **p_result = owner;
+
+	while (ncmds--)
+		*(*p_result)++ = ret;
+}
+
+void transmit_x10_batch(int fd, struct x10_command *cmds, int count,
+	int target, int *results)
+{
+	struct x10_tx_queue txq;
+	int *p_result = results;
+
+	x10_txq_init(&txq, &batch_x10_report);
+	if (x10_txq_push(fd, &txq, cmds, count, target, &p_result) < 0)
+		fail("Too many commands in a batch");
+	x10_txq_flush(fd, &txq);
+}
+
 /*
  * Helper function for "listenraw" command
  */
+static __thread int x10_print_pos = 0;
+
 static void x10_print_bit(uint8_t bit)
 {
-	static int pos = 0;
 	fprintf(stderr, "%d", bit);
-	if (++pos == 48) {
+	if (++x10_print_pos == 48) {
 		fprintf(stderr, "\n");
-		pos = 0;
+		x10_print_pos = 0;
 	}
 	fflush(stderr);
 }
 
-static int x10_deinterleave(uint32_t buf, uint8_t bits)
+static void x10_print_octet(uint8_t octet)
 {
-	int tmp = 0;
-	int check = 0;
 	int i;
 
-	for (i = bits ; i > 0; --i) {
-		tmp <<= 1;
-		check <<= 1;
-		if (buf & (1L << (i * 2 - 1)))
-			tmp += 1;
-		if (!(buf & (1L << (i * 2 - 2))))
-			check += 1;
-		if (check != tmp)
-			return -1;
-	}
-	return tmp;
+	for (i = 7; i >= 0; i--)
+		x10_print_bit((octet >> i) & 1);
 }
 
-void (*feed_bit_callback)(uint8_t);
-void (*commit_x10_callback)(struct x10_command*);
+static void x10_print_gap(void)
+{
+	fprintf(stderr, "%s<gap>\n", x10_print_pos ? "\n" : "");
+	x10_print_pos = 0;
+}
 
-enum x10_state {
-	X10_STATE_IDLE,
-	X10_STATE_BASIC,
-	X10_STATE_EXTENDED,
-	X10_STATE_RECOVER,
-	X10_STATE_RECEIVED,
-};
+__thread void (*feed_octet_callback)(uint8_t);
+__thread void (*flush_bits_callback)(void);
 
-/* Decodes X10 bitstream and executes callback function
- * when a valid transmission is found.
+/*
+ * Decoder of the received bits, for "listen", "daemon" and "cm11"
  */
 
-void x10_decode_bit(uint8_t bit)
+static __thread struct x10_decoder rx_decoder;
+
+void x10_decode_init(void (*commit)(void *data, struct x10_command *cmd),
+	void *data)
 {
-	static enum x10_state state = X10_STATE_IDLE;
-	static uint32_t buf = 0;
-	int tmp;
-	static uint32_t rbuf, last_rbuf;
-	static struct x10_command a_cmd;
-	static int counter = 0;
-	int commit_command = 0;
-	static int repeats = 0;
+	x10_decoder_init(&rx_decoder, commit, data);
+}
 
+void x10_decode_octet(uint8_t octet)
+{
 	if (verbosity >=2)
-		x10_print_bit(bit);
+		x10_print_octet(octet);
+	x10_decoder_feed_octet(&rx_decoder, octet);
+}
+
+void x10_decode_flush(void)
+{
+	x10_decoder_flush(&rx_decoder);
+}
+
+/*
+ * Adaptive receive polling.
+ *
+ * The module keeps the last X10_BITSTREAM_OCTETS of received bits in
+ * a ring. While the line is quiet, the ring is polled just often enough
+ * to keep it no more than 3/4 full; should it overrun anyway, the bit
+ * counter tells so and the decoder is resynchronized. Once a start code
+ * is seen, polling goes as fast as the module publishes the bits (one
+ * octet at a time), until the line is quiet again.
+ *
+ * Polls use DELTA requests, sized by the number of octets expected since
+ * the previous poll. When more have arrived, or the reply is damaged, the
+ * whole message is polled instead.
+ *
+ * A module built with X10_DECODE decodes the frames itself and keeps
+ * them in a queue of records. Then the decoder is fed with COMMANDS
+ * replies instead of bits, and the queue is polled at a fixed pace, just
+ * often enough for the shortest frames not to overrun it.
+ */
+
+#define X10_RX_RING_BITS (X10_BITSTREAM_OCTETS*8)
+#define X10_RX_TARGET_FILL (X10_RX_RING_BITS*3/4)
+#define X10_RX_BUSY_BITS 8	// poll period on a busy line
+#define X10_RX_QUIET_BITS 48	// line is quiet after this many bits
+#define X10_RX_RECORD_BITS 28	// shortest record: a frame and the gap
+
+struct x10_rx_sched {
+	int64_t interval_us;	// current poll period
+	int64_t last_us;	// time of the last poll
+	int quiet_bits;		// bits since the last start code
+	uint8_t shift;		// recent bits, for start code detection
+	int records;		// module decodes: 1 yes, -1 no, 0 not known
+	uint8_t record_seq;	// records seen
+	struct x10_rx_stats stats;
+};
 
-	buf = (buf << 1) + bit;
-	counter++;
+static __thread struct x10_rx_sched rx_sched;
 
-	if (state != X10_STATE_IDLE && (buf & 0b111111) == 0) {
-		plog(1, "Force return to idle state\n");
-		state = X10_STATE_IDLE;
-		buf = 0;
+static void x10_rx_sched_update(int fill, int64_t now)
+{
+	struct x10_rx_sched *rs = &rx_sched;
+	struct x10_rx_stats *st = &rs->stats;
+	int64_t quiet_us = x10_bits_us(X10_RX_TARGET_FILL);
+	int64_t latency = x10_bits_us(fill);
+
+	if (st->polls == 0)
+		st->first_us = now;
+	st->polls++;
+	st->bits += fill;
+	st->latency_sum_us += latency;
+	if (fill > st->max_fill)
+		st->max_fill = fill;
+	if (latency > st->max_latency_us)
+		st->max_latency_us = latency;
+
+	if (st->polls == 1) {
+		// The first poll gets the whole ring, it says nothing
+		rs->interval_us = quiet_us;
+	} else if (rs->quiet_bits < X10_RX_QUIET_BITS) {
+		rs->interval_us = x10_bits_us(X10_RX_BUSY_BITS);
+	} else if (fill > X10_RX_TARGET_FILL) {
+		// We are late, shrink the period proportionally
+		rs->interval_us = rs->interval_us * X10_RX_TARGET_FILL / fill;
+		if (rs->interval_us < x10_bits_us(X10_RX_BUSY_BITS))
+			rs->interval_us = x10_bits_us(X10_RX_BUSY_BITS);
+	} else {
+		// Grow back slowly towards the quiet period
+		rs->interval_us += rs->interval_us / 4 + 1;
+		if (rs->interval_us > quiet_us)
+			rs->interval_us = quiet_us;
 	}
+	rs->last_us = now;
+}
 
-	switch (state) {
-	case X10_STATE_IDLE:
-		if (last_rbuf && counter == 5)
-			commit_command = 1;
-		if ((buf & 0xF) != 0xE)
-			break;
-		plog(1, "Start condition detected\n");
-		counter = 0;
-		rbuf = 0;
-		state = X10_STATE_BASIC;
-		break;
-	case X10_STATE_BASIC:
-	case X10_STATE_EXTENDED:
-		if (counter % 2)
-			break;
-		tmp = x10_deinterleave(buf, 1);
-		if (tmp == -1) {
-			plog(1, "The transmission is invalid\n");
-			state = X10_STATE_RECOVER;
-			break;
-		}
-		rbuf = (rbuf << 1) + tmp;
-		if (counter < 18)
-			break;
-		if (counter == 18) {
-			if ((rbuf & 1) && _x10_decode[(rbuf >> 1) & 0xF] 
-				== X10_FUNC_EXTENDEDCODE) {
-				state = X10_STATE_EXTENDED;
-				break;
-			}
-			rbuf <<= 20;
-			state = X10_STATE_RECEIVED;
-		}
-		if (counter < 58)
-			break;
-		state = X10_STATE_RECEIVED;
-		break;
-	default:
-		break;
+/*
+ * Time left until the next receive poll is due.
+ * Returns: delay in ms
+ */
+
+long x10_rx_delay(void)
+{
+	int64_t left = rx_sched.last_us + rx_sched.interval_us - monotonic_us();
+
+	return (left > 0) ? (left + 999) / 1000 : 0;
+}
+
+void x10_rx_stats_get(struct x10_rx_stats *st)
+{
+	*st = rx_sched.stats;
+}
+
+void x10_rx_stats_log(int level)
+{
+	struct x10_rx_stats *st = &rx_sched.stats;
+	int64_t elapsed = monotonic_us() - st->first_us;
+
+	if (!st->polls)
+		return;
+	plog(level, "Receive polls: %ld (%.2f/s), %.1f bits/poll, "
+		"max fill %d, latency mean %lld us, max %ld us, "
+		"%ld overruns, %ld bits lost, %ld delta, %.1f octets/poll\n",
+		st->polls, elapsed ? st->polls * 1e6 / elapsed : 0.0,
+		(double)st->bits / st->polls, st->max_fill,
+		st->latency_sum_us / st->polls, st->max_latency_us,
+		st->overruns, st->lost_bits, st->delta_polls,
+		(double)st->spi_octets / st->polls);
+	if (st->record_polls)
+		plog(level, "Record polls: %ld, %ld records lost\n",
+			st->record_polls, st->lost_records);
+	if (link_stats.replies)
+		plog(level, "SPI replies: %ld, %ld CRC errors (%.3f%%)\n",
+			link_stats.replies, link_stats.crc_errors,
+			100.0 * link_stats.crc_errors / link_stats.replies);
+}
+
+/*
+ * Number of octets the module should have published since the last poll.
+ */
+
+static int x10_rx_expected_octets(int64_t now)
+{
+	int octets = (now - rx_sched.last_us) / x10_bits_us(8) + 2;
+
+	return (octets > SPI_DELTA_MAX_OCTETS) ? SPI_DELTA_MAX_OCTETS : octets;
+}
+
+/*
+ * Feed the octets to the decoder, starting at rx_tail of the ring.
+ * The module publishes whole octets only.
+ */
+
+static void x10_rx_feed(const uint8_t *data, int rx_tail, int octets)
+{
+	uint8_t octet;
+	int i;
+
+	for (i = 0; i < octets; i++) {
+		octet = data[rx_tail];
+		(*feed_octet_callback)(octet);
+		if(++rx_tail == X10_BITSTREAM_OCTETS)
+			rx_tail = 0;
+		if (x10_start_code(rx_sched.shift, octet))
+			rx_sched.quiet_bits = 0;
+		else if (rx_sched.quiet_bits < X10_RX_QUIET_BITS)
+			rx_sched.quiet_bits += 8;
+		rx_sched.shift = octet;
 	}
+}
 
-	if (state == X10_STATE_RECEIVED) {
-		plog(1, "The received code seems valid: %.8X\n", rbuf);
-		// This is a mark to distinguish empty code from zero code
-		rbuf |= 1<<31; 
-		if (last_rbuf) {
-			if (last_rbuf == rbuf) {
-				repeats++;
-				plog(1, "The code is same as before\n");
-			} else {
-				commit_command = 1;
-				repeats = 1;
-			}
-		} else {
-			repeats = 1;
+/*
+ * Check if the module decodes the frames itself.
+ * Returns: 1 if it does, -1 if not
+ */
+
+static int spi_records_probe(int fd)
+{
+	uint8_t reply[sizeof(struct spi_message)];
+	int try;
+
+	// A module without X10_DECODE takes the request for a damaged one
+	for (try = 0; try < 3; try++)
+		if (spi_commands_receive(fd, 0, 0, reply) == 0) {
+			plog(1, "The module decodes X10 by itself\n");
+			rx_sched.record_seq = reply[2];
+			return 1;
 		}
+	plog(1, "The module sends raw X10 bits\n");
+	return -1;
+}
+
+static void x10_record_command(const uint8_t *rec, struct x10_command *cmd)
+{
+	int repeats = rec[1] & SPI_RECORD_REPEATS;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->hc = _x10_decode[rec[0] >> 4];
+	if (rec[1] & SPI_RECORD_EXTENDED) {
+		cmd->fc = X10_FUNC_EXTENDEDCODE;
+		cmd->func_rpt = repeats;
+		cmd->uc = _x10_decode[rec[0] & 0xF];
+		cmd->x_byte_1 = rec[2];
+		cmd->x_byte_2 = rec[3];
+	} else if (rec[1] & SPI_RECORD_FUNCTION) {
+		cmd->fc = _x10_decode[rec[0] & 0xF];
+		cmd->func_rpt = repeats;
+	} else {
+		cmd->uc = _x10_decode[rec[0] & 0xF];
+		cmd->addr_rpt = repeats;
 	}
+}
 
-	if (last_rbuf && state == X10_STATE_RECOVER)
-		commit_command = 1;
+/*
+ * Receive the frames decoded by the module and commit them, as the
+ * decoder would.
+ * Returns: number of new records
+ */
 
-	if (commit_command) {
-		plog(1, "Committing the command!\n");
-		memset(&a_cmd, 0, sizeof(a_cmd));
-		a_cmd.hc=_x10_decode[(last_rbuf >> 25) & 0xF];
-		if ((last_rbuf >> 20) & 1) {
-			a_cmd.fc = _x10_decode[(last_rbuf >> 21) & 0xF];
-			a_cmd.func_rpt = repeats;
-		} else {
-			a_cmd.uc = _x10_decode[(last_rbuf >> 21) & 0xF];
-			a_cmd.addr_rpt = repeats;
-		}
-		if (a_cmd.fc == X10_FUNC_EXTENDEDCODE) {
-			a_cmd.uc = _x10_decode[(last_rbuf >> 16) & 0xF];
-			a_cmd.x_byte_1 = (last_rbuf >> 8) & 0xFF;
-			a_cmd.x_byte_2 = last_rbuf & 0xFF;
-		}
-		(*commit_x10_callback)(&a_cmd);
-		last_rbuf = 0;
-		repeats = 0;
+static int spi_x10_poll_records(int fd, int64_t now)
+{
+	uint8_t reply[sizeof(struct spi_message)];
+	struct x10_rx_stats *st = &rx_sched.stats;
+	struct x10_command cmd;
+	int count, lost, i;
+
+	count = spi_commands_receive(fd, rx_sched.record_seq,
+		SPI_COMMANDS_MAX, reply);
+	st->spi_octets += SPI_COMMANDS_HEADER
+		+ SPI_COMMANDS_MAX * SPI_RECORD_OCTETS + 2;
+	link_stats.replies++;
+	rx_sched.last_us = now;
+	if (count < 0) {
+		plog(1, "<<< COMMANDS reply CRC ERROR <<<\n");
+		link_stats.crc_errors++;
+		rx_sched.interval_us = x10_bits_us(X10_RX_BUSY_BITS);
+		return 0;
 	}
 
-	if (state == X10_STATE_RECEIVED) {
-		last_rbuf = rbuf;
-		buf = 0;
-		counter = 0;
-		state = X10_STATE_IDLE;
+	if (st->polls == 0)
+		st->first_us = now;
+	st->polls++;
+	st->record_polls++;
+	rx_sched.interval_us = x10_bits_us(SPI_COMMANDS_MAX
+		* X10_RX_RECORD_BITS) * 3 / 4;
+
+	lost = (uint8_t)(reply[3] - rx_sched.record_seq);
+	if (lost) {
+		plog(1, "Record queue overrun, %d records lost\n", lost);
+		st->overruns++;
+		st->lost_records += lost;
+	}
+	rx_sched.record_seq = reply[3] + count;
+
+	if (count)
+		plog(2, "<<< COMMANDS reply: %d records <<<\n", count);
+	for (i = 0; i < count; i++) {
+		x10_record_command(reply + SPI_COMMANDS_HEADER
+			+ i * SPI_RECORD_OCTETS, &cmd);
+		(*rx_decoder.commit)(rx_decoder.data, &cmd);
 	}
+	return count;
 }
 
-void spi_x10_poll(int fd)
+/*
+ * Receive the new bits from the module and feed them to the decoder.
+ * Returns: number of new bits, or records if the module decodes
+ */
+
+int spi_x10_poll(int fd)
 {
-	static int rx_tail = -1;
-	uint8_t bit;
+	static __thread int rx_seq_valid = 0;
+	static __thread uint16_t rx_seq;
+	uint8_t reply[SPI_DELTA_HEADER + SPI_DELTA_MAX_OCTETS + 2];
 	struct spi_message spi_rx;
-	int ret;
+	int64_t now = monotonic_us();
+	int ret, max, count;
+	int fill, lost;
+
+	// Raw listening has no decoder, it needs the bits
+	if (rx_sched.records == 0 && rx_decoder.commit)
+		rx_sched.records = spi_records_probe(fd);
+	if (rx_sched.records > 0)
+		return spi_x10_poll_records(fd, now);
+
+	if (rx_seq_valid) {
+		max = x10_rx_expected_octets(now);
+		count = spi_delta_receive(fd, rx_seq >> 3, max, reply);
+		rx_sched.stats.spi_octets += SPI_DELTA_HEADER + max + 2;
+		link_stats.replies++;
+		fill = count * 8;
+		if (count >= 0 && (uint16_t)(reply[2] + (reply[3] << 8) - rx_seq)
+			== fill) {
+			plog(2, "<<< DELTA reply: %d octets <<<\n", count);
+			rx_seq += fill;
+			rx_sched.stats.delta_polls++;
+			x10_rx_feed(reply + SPI_DELTA_HEADER, 0, count);
+			x10_rx_sched_update(fill, now);
+			return fill;
+		}
+		if (count < 0) {
+			plog(1, "<<< DELTA reply CRC ERROR <<<\n");
+			link_stats.crc_errors++;
+		}
+	}
 
 	ret = reliable_spi_transfer(fd, NULL, &spi_rx, 0);
 	if (!ret)
 		fail("SPI receive has failed");
 	log_spi_message(2, &spi_rx);
-	if (rx_tail == -1) {
+	rx_sched.stats.spi_octets += (MAX_SPI_TRIES - ret + 1)
+		* sizeof(struct spi_message);
+
+	// The module counts every received bit, so the host knows exactly
+	// how many bits have passed since the last poll
+	fill = (uint16_t)(spi_rx.rx_seq - rx_seq);
+	if (!rx_seq_valid) {
 		// feed the whole buffer
-		rx_tail = spi_rx.x10_data.tail+1;
-	}
-	while (rx_tail != spi_rx.x10_data.tail) {
-		bit = (spi_rx.x10_data.data[rx_tail/8] 
-			>> (7 - rx_tail % 8)) & 1;
-		(*feed_bit_callback)(bit);
-		if(++rx_tail == X10_BITSTREAM_OCTETS*8)
-			rx_tail = 0;
+		if (spi_rx.rx_seq > X10_RX_RING_BITS)
+			fill = X10_RX_RING_BITS;
+		rx_sched.quiet_bits = X10_RX_QUIET_BITS;
+		rx_seq_valid = 1;
+	} else if (fill > X10_RX_RING_BITS) {
+		// We are late, the oldest bits are overwritten
+		lost = fill - X10_RX_RING_BITS;
+		plog(1, "Receive ring overrun, %d bits lost\n", lost);
+		rx_sched.stats.overruns++;
+		rx_sched.stats.lost_bits += lost;
+		if (flush_bits_callback)
+			(*flush_bits_callback)();
+		fill = X10_RX_RING_BITS;
 	}
+	rx_seq = spi_rx.rx_seq;
+
+	x10_rx_feed(spi_rx.x10_data.data, (spi_rx.x10_data.tail
+		+ X10_RX_RING_BITS - fill) % X10_RX_RING_BITS / 8, fill / 8);
 
+	x10_rx_sched_update(fill, monotonic_us());
+	return fill;
 }
 
 /*
  * Helper function for "listen" command
  */
-static void display_x10_command(struct x10_command *p_cmd)
+static void display_x10_command(void *data, struct x10_command *p_cmd)
 {
 	log_command(0, p_cmd);
 }
@@ -820,21 +1843,456 @@ static void display_x10_command(struct x10_command *p_cmd)
  */
 static void spi_x10_listen(int fd)
 {
-	struct timespec ts_rq;
+	int64_t last_log = monotonic_us();
 
 	while (1) {
 		spi_x10_poll(fd);
-		ts_rq.tv_sec = 0;
-		ts_rq.tv_nsec = 100000000L; // 100ms
-		while(nanosleep(&ts_rq, &ts_rq));
+		if (monotonic_us() - last_log > 60000000LL) {
+			x10_rx_stats_log(1);
+			last_log = monotonic_us();
+		}
+		sleep_ms(x10_rx_delay());
+	}
+
+}
+
+/*
+ * Self test of the table-driven code against the reference code.
+ * Does not need the module.
+ */
+
+static int64_t selftest_start;
+
+static void selftest_timer(void)
+{
+	selftest_start = monotonic_us();
+}
+
+static double selftest_rate(long count)
+{
+	int64_t elapsed = monotonic_us() - selftest_start;
+
+	return elapsed ? count * 1000.0 / elapsed : 0.0;
+}
+
+static int selftest_frames(void)
+{
+	struct x10_bitstream garbage, a, b;
+	int tail, f, hc, uc, b1, b2, i;
+	int bad = 0;
+	long count;
+
+	for (i = 0; i < sizeof(garbage.data); i++)
+		garbage.data[i] = rand();
+
+	// Every basic frame at every offset
+	for (tail = 0; tail <= X10_BITSTREAM_OCTETS*8; tail++)
+		for (f = 0; f < 2; f++)
+			for (hc = 0; hc < 16; hc++)
+				for (uc = 0; uc < 16; uc++) {
+					a = garbage;
+					a.tail = tail;
+					b = a;
+					if ((x10_basic_bitwise(&a, hc, uc, f) == NULL)
+						!= (x10_basic(&b, hc, uc, f) == NULL)
+						|| memcmp(&a, &b, sizeof(a)))
+						bad++;
+				}
+	plog(0, "Basic frames: %s\n", bad ? "FAILED" : "ok");
+
+	// Every extended code at every bit alignment, and at the end
+	for (tail = 0; tail <= X10_BITSTREAM_OCTETS*8; tail++) {
+		if (tail == 8)
+			tail = X10_BITSTREAM_OCTETS*8 - 48;
+		for (uc = 0; uc < 16; uc++)
+			for (b1 = 0; b1 < 256; b1++)
+				for (b2 = 0; b2 < 256; b2++) {
+					a = garbage;
+					a.tail = tail;
+					b = a;
+					if ((x10_extended_code_bitwise(&a, uc, b1, b2)
+						== NULL) != (x10_extended_code(&b, uc,
+						b1, b2) == NULL)
+						|| memcmp(&a, &b, sizeof(a)))
+						bad++;
+				}
+	}
+	plog(0, "Extended codes: %s\n", bad ? "FAILED" : "ok");
+
+	count = 0;
+	selftest_timer();
+	for (i = 0; i < 1000; i++)
+		for (hc = 0; hc < 16; hc++)
+			for (uc = 0; uc < 16; uc++) {
+				a.tail = (i + uc) % 8;
+				x10_basic_bitwise(&a, hc, uc, 0);
+				count++;
+			}
+	plog(0, "Basic frames, bitwise: %.0f per ms\n", selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < 1000; i++)
+		for (hc = 0; hc < 16; hc++)
+			for (uc = 0; uc < 16; uc++) {
+				a.tail = (i + uc) % 8;
+				x10_basic(&a, hc, uc, 0);
+			}
+	plog(0, "Basic frames, tables: %.0f per ms\n", selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < count; i++) {
+		a.tail = i % 8;
+		x10_extended_code_bitwise(&a, i % 16, i, i >> 8);
+	}
+	plog(0, "Extended codes, bitwise: %.0f per ms\n",
+		selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < count; i++) {
+		a.tail = i % 8;
+		x10_extended_code(&a, i % 16, i, i >> 8);
+	}
+	plog(0, "Extended codes, tables: %.0f per ms\n", selftest_rate(count));
+
+	return bad;
+}
+
+static uint16_t selftest_crc_reference(const uint8_t *data, int len)
+{
+	uint16_t crc = 0xffff;
+
+	while (len--)
+		crc = crc_ccitt_update(crc, *data++);
+	return u16_reverse(crc);
+}
+
+static int selftest_crc(void)
+{
+	uint8_t data[64];
+	struct spi_message msg;
+	uint16_t sum = 0;
+	int len, i, j;
+	int bad = 0;
+	long count = 100000;
+
+	for (len = 0; len <= sizeof(data); len++)
+		for (i = 0; i < 1000; i++) {
+			for (j = 0; j < len; j++)
+				data[j] = rand();
+			if (u16_reverse_table(crc_ccitt_block(0xffff, data, len))
+				!= selftest_crc_reference(data, len)
+				|| crc_ccitt_table(0xffff, data, len)
+				!= crc_ccitt_block(0xffff, data, len))
+				bad++;
+		}
+	for (i = 0; i < 65536; i++)
+		if (u16_reverse_table(i) != u16_reverse(i))
+			bad++;
+	plog(0, "CRC: %s\n", bad ? "FAILED" : "ok");
+
+	for (j = 0; j < sizeof(msg); j++)
+		((uint8_t *)&msg)[j] = rand();
+	selftest_timer();
+	for (i = 0; i < count; i++) {
+		msg.rr_id = i;
+		sum += selftest_crc_reference((uint8_t *)&msg, sizeof(msg)-2);
+	}
+	plog(0, "Message CRC, bitwise reverse: %.0f per ms\n",
+		selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < count; i++) {
+		msg.rr_id = i;
+		sum += u16_reverse_table(crc_ccitt_table(0xffff,
+			(uint8_t *)&msg, sizeof(msg)-2));
 	}
+	plog(0, "Message CRC, byte table: %.0f per ms\n", selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < count; i++) {
+		msg.rr_id = i;
+		sum += spi_crc16(&msg);
+	}
+	plog(0, "Message CRC, slice-by-8: %.0f per ms\n", selftest_rate(count));
+	plog(2, "CRC sum %.4X\n", sum);
+
+	return bad;
+}
 
+/*
+ * The firmware keeps the CRC of its reply up to date only when the reply
+ * changes. It has to be the CRC of the whole message all the same.
+ */
+
+static int selftest_reply_crc(void)
+{
+	long count = 200000, bad;
+
+	fwsim_init(1000, 0);
+	fwsim_decode_init(1000, 0);
+	bad = fwsim_reply_crc_check(count)
+		+ fwsim_decode_reply_crc_check(count);
+	plog(0, "Firmware reply CRC: %s, %ld of %ld commits wrong\n",
+		bad ? "FAILED" : "ok", bad, count * 2);
+	return bad != 0;
+}
+
+#define SELFTEST_DECODED 64
+
+struct selftest_decoded {
+	struct x10_command cmds[SELFTEST_DECODED];
+	int n;
+};
+
+static void selftest_decoded_commit(void *data, struct x10_command *cmd)
+{
+	struct selftest_decoded *d = data;
+
+	if (d->n < SELFTEST_DECODED)
+		d->cmds[d->n++] = *cmd;
+}
+
+/*
+ * A bitstream of random frames and pauses, between random bits
+ * or zeros, with a few bits flipped now and then.
+ */
+
+static void selftest_stream(struct x10_bitstream *bs)
+{
+	int i;
+
+	for (i = 0; i < sizeof(bs->data); i++)
+		bs->data[i] = rand();
+	bs->tail = rand() % 32;
+	for (;;) {
+		i = rand() % 8;
+		if (i < 4) {
+			if (!x10_basic(bs, rand() % 16, rand() % 16, i & 1))
+				break;
+		} else if (i < 5) {
+			if (!x10_basic(bs, rand() % 16, X10_FUNC_EXTENDEDCODE, 1)
+				|| !x10_extended_code(bs, rand() % 16, rand(),
+				rand()))
+				break;
+		} else if (!x10_pause(bs, (i - 4) * 3))
+			break;
+	}
+	if (rand() % 2)
+		x10_pause(bs, X10_BITSTREAM_OCTETS*8 - bs->tail);
+	for (i = rand() % 4; i > 0; i--)
+		bs->data[rand() % sizeof(bs->data)] ^= 1 << (rand() % 8);
+}
+
+/*
+ * The octet decoder has to commit just what the bit decoder does.
+ */
+
+static int selftest_decoder(void)
+{
+	static struct x10_bitstream streams[1000];
+	struct selftest_decoded by_bit, by_octet;
+	struct x10_decoder bit_dec, octet_dec;
+	int i, j, k;
+	int bad = 0;
+	long commits = 0, count;
+
+	x10_decoder_init(&bit_dec, &selftest_decoded_commit, &by_bit);
+	x10_decoder_init(&octet_dec, &selftest_decoded_commit, &by_octet);
+	for (i = 0; i < 100000; i++) {
+		selftest_stream(&streams[0]);
+		by_bit.n = by_octet.n = 0;
+		for (j = 0; j < sizeof(streams[0].data); j++) {
+			for (k = 7; k >= 0; k--)
+				x10_decoder_feed(&bit_dec,
+					(streams[0].data[j] >> k) & 1);
+			x10_decoder_feed_octet(&octet_dec, streams[0].data[j]);
+		}
+		if (i % 100 == 0) {
+			x10_decoder_flush(&bit_dec);
+			x10_decoder_flush(&octet_dec);
+		}
+		if (by_bit.n != by_octet.n || memcmp(by_bit.cmds, by_octet.cmds,
+			by_bit.n * sizeof(by_bit.cmds[0])))
+			bad++;
+		commits += by_bit.n;
+	}
+	plog(0, "Decoder: %s, %ld commands\n", bad ? "FAILED" : "ok",
+		commits);
+
+	for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+		selftest_stream(&streams[i]);
+	count = sizeof(streams) / sizeof(streams[0]) * sizeof(streams[0].data);
+	selftest_timer();
+	for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+		for (j = 0; j < sizeof(streams[0].data); j++)
+			for (k = 7; k >= 0; k--) {
+				by_bit.n = 0;
+				x10_decoder_feed(&bit_dec,
+					(streams[i].data[j] >> k) & 1);
+			}
+	plog(0, "Decoder, bitwise: %.0f octets per ms\n", selftest_rate(count));
+	selftest_timer();
+	for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+		for (j = 0; j < sizeof(streams[0].data); j++) {
+			by_octet.n = 0;
+			x10_decoder_feed_octet(&octet_dec, streams[i].data[j]);
+		}
+	plog(0, "Decoder, tables: %.0f octets per ms\n", selftest_rate(count));
+
+	return bad;
+}
+
+#define SELFTEST_RECORDS 16
+
+static struct x10_command selftest_got[SELFTEST_RECORDS];
+static int selftest_ngot;
+
+static void selftest_commit(void *data, struct x10_command *cmd)
+{
+	if (selftest_ngot < SELFTEST_RECORDS)
+		selftest_got[selftest_ngot++] = *cmd;
+}
+
+/*
+ * The records the decoder makes of a command: the address frames, then
+ * the function frames.
+ */
+
+static int selftest_expect(const struct x10_command *cmd,
+	struct x10_command *rec)
+{
+	int n = 0;
+
+	if (cmd->addr_rpt) {
+		memset(&rec[n], 0, sizeof(rec[n]));
+		rec[n].hc = cmd->hc;
+		rec[n].uc = cmd->uc;
+		rec[n++].addr_rpt = cmd->addr_rpt;
+	}
+	if (cmd->func_rpt) {
+		memset(&rec[n], 0, sizeof(rec[n]));
+		rec[n].hc = cmd->hc;
+		rec[n].fc = cmd->fc;
+		rec[n].func_rpt = cmd->func_rpt;
+		if (cmd->fc == X10_FUNC_EXTENDEDCODE) {
+			rec[n].uc = cmd->uc;
+			rec[n].x_byte_1 = cmd->x_byte_1;
+			rec[n].x_byte_2 = cmd->x_byte_2;
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Send commands to the firmware simulator and decode them as they come
+ * back from the line, with error_ppm SPI octets damaged per million.
+ * With decode, the firmware built with X10_DECODE decodes them, and they
+ * come back in COMMANDS replies. The mains run at 1 kHz, 20 times faster
+ * than real time.
+ */
+
+static int selftest_loopback(int error_ppm, int send, int decode)
+{
+	static const char *commands[] = { "a1:on", "p16:off",
+		"c:alllightson", "b7:dim", "e3:xpreset[17]", "m12:bright" };
+	struct x10_command cmd, want[2];
+	struct x10_link_stats lst;
+	struct x10_rx_stats rst;
+	struct fwsim_stats st;
+	int i, j, n, ok, bad = 0;
+	long replies, crc_errors, polls, delta_polls;
+
+	transport = decode ? &fwsim_decode_transport : &fwsim_transport;
+	compact_send = send;
+	mains_hz = 1000;
+	if (decode)
+		fwsim_decode_init(mains_hz, error_ppm);
+	else
+		fwsim_init(mains_hz, error_ppm);
+	feed_octet_callback = &x10_decode_octet;
+	flush_bits_callback = &x10_decode_flush;
+	x10_decode_init(&selftest_commit, NULL);
+	// Probe the module anew
+	rx_sched.records = 0;
+	x10_link_stats_get(&lst);
+	replies = lst.replies;
+	crc_errors = lst.crc_errors;
+	x10_rx_stats_get(&rst);
+	polls = rst.polls;
+	delta_polls = rst.delta_polls;
+
+	selftest_timer();
+	spi_x10_poll(-1);
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		parse_command(commands[i], &cmd);
+		n = selftest_expect(&cmd, want);
+		selftest_ngot = 0;
+		transmit_x10_batch(-1, &cmd, 1, SPI_RESPONSE_COMPLETE, &ok);
+		for (j = 0; j < 50 && selftest_ngot < n; j++) {
+			sleep_ms(x10_rx_delay());
+			spi_x10_poll(-1);
+		}
+		if (!ok || selftest_ngot != n
+			|| memcmp(selftest_got, want, n * sizeof(want[0]))) {
+			plog(0, "Loopback of %s has failed\n", commands[i]);
+			bad++;
+		}
+	}
+
+	if (send && module_send <= 0) {
+		plog(0, "Loopback has sent bitstreams instead of SEND\n");
+		bad++;
+	}
+	if ((rx_sched.records > 0) != decode) {
+		plog(0, "Loopback has received %s\n",
+			decode ? "bits instead of records" : "records");
+		bad++;
+	}
+	// Every poll but the first one takes a DELTA reply, unless damaged
+	x10_rx_stats_get(&rst);
+	if (!decode && !error_ppm
+		&& rst.delta_polls - delta_polls < rst.polls - polls - 1) {
+		plog(0, "Loopback has polled without DELTA\n");
+		bad++;
+	}
+
+	if (decode)
+		fwsim_decode_stats_get(&st);
+	else
+		fwsim_stats_get(&st);
+	x10_link_stats_get(&lst);
+	plog(0, "Loopback of %s%s, %d ppm errors: %s, %.0f times real time, "
+		"%ld transfers, %ld octets damaged, %ld of %ld replies "
+		"damaged\n", send ? "SEND" : "bitstreams",
+		decode ? " to COMMANDS" : "", error_ppm,
+		bad ? "FAILED" : "ok",
+		selftest_rate(st.crossings) * 1000 / 100, st.transfers,
+		st.corrupted, lst.crc_errors - crc_errors,
+		lst.replies - replies);
+	transport = &spidev_transport;
+	return bad;
+}
+
+static int x10_selftest(void)
+{
+	int bad = 0;
+
+	bad += selftest_crc();
+	bad += selftest_reply_crc();
+	bad += selftest_frames();
+	bad += selftest_decoder();
+	bad += selftest_loopback(0, 1, 0);
+	bad += selftest_loopback(5000, 1, 0);
+	bad += selftest_loopback(0, 0, 0);
+	bad += selftest_loopback(0, 1, 1);
+	bad += selftest_loopback(5000, 0, 1);
+	plog(0, "Self test %s\n", bad ? "FAILED" : "passed");
+	return bad;
 }
 
 static void print_usage(const char *prog)
 {
-	fprintf(stderr, "Usage: %s [-DsbdlHOLC3] command ...\n", prog);
-	fprintf(stderr, "  -D --device   device to use (default /dev/spidev1.1)\n"
+	fprintf(stderr, "Usage: %s [-DsbdlHOLC3SmBET] command ...\n", prog);
+	fprintf(stderr, "  -D --device   device to use (default /dev/spidev1.1),\n"
+	     "                " SPI_SOCKET_PREFIX "path for the simulator served by the\n"
+	     "                \"simulator\" command; the daemon takes up to 8,\n"
+	     "                as device@houses, e.g. /dev/spidev0.1@a-dk\n"
 	     "  -s --speed    max speed (Hz)\n"
 	     "  -d --delay    delay (usec)\n"
 	     "  -b --bpw      bits per word \n"
@@ -848,6 +2306,14 @@ static void print_usage(const char *prog)
 	     "  -R --ready    use SPI ready input\n"
 	     "  -v --verbose  increase verbosity level\n"
 	     "  -F --ff       fire-and-forget X10 transmit\n"
+	     "  -S --socket   daemon socket path (default " X10_DAEMON_SOCKET ")\n"
+	     "  -m --mains    mains frequency (Hz, default 50)\n"
+	     "  -B --bitstream  transmit bitstreams built by the host, as\n"
+	     "                for a module found not to take SEND requests\n"
+	     "  -E --emulate[=ppm]  talk to the firmware simulator, which\n"
+	     "                damages ppm SPI octets per million\n"
+	     "  -T --pty      serve cm11 on this many pseudo-terminals (1..8)\n"
+	     "                rather than stdin and stdout\n"
 );
 	exit(1);
 }
@@ -870,18 +2336,25 @@ static void parse_opts(int argc, char *argv[])
 			{ "ready",   0, 0, 'R' },
 			{ "verbose", 0, 0, 'v' },
 			{ "ff",      0, 0, 'F' },
+			{ "socket",  1, 0, 'S' },
+			{ "mains",   1, 0, 'm' },
+			{ "bitstream", 0, 0, 'B' },
+			{ "emulate", 2, 0, 'E' },
+			{ "pty",     1, 0, 'T' },
 			{ NULL, 0, 0, 0 },
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3NRvF", lopts, NULL);
+		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3NRvFS:m:BE::T:", lopts, NULL);
 
 		if (c == -1)
 			break;
 
 		switch (c) {
 		case 'D':
-			device = optarg;
+			if (ndevices == X10_MAX_DEVICES)
+				fail("Too many devices");
+			devices[ndevices++] = optarg;
 			break;
 		case 's':
 			speed = atoi(optarg);
@@ -922,6 +2395,27 @@ static void parse_opts(int argc, char *argv[])
 		case 'F':
 			spi_trx_target = SPI_RESPONSE_SEEN;
 			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'm':
+			mains_hz = atoi(optarg);
+			if (mains_hz <= 0)
+				print_usage(argv[0]);
+			break;
+		case 'B':
+			compact_send = 0;
+			break;
+		case 'E':
+			emulate = optarg ? atoi(optarg) : 0;
+			if (emulate < 0 || emulate > 1000000)
+				print_usage(argv[0]);
+			break;
+		case 'T':
+			cm11_ptys = atoi(optarg);
+			if (cm11_ptys < 1 || cm11_ptys > CM11_MAX_CLIENTS)
+				print_usage(argv[0]);
+			break;
 		default:
 			print_usage(argv[0]);
 			break;
@@ -931,62 +2425,45 @@ static void parse_opts(int argc, char *argv[])
 
 static int init(int argc, char *argv[])
 {
-	int ret = 0;
-	int fd;
-
 	parse_opts(argc, argv);
 
-	fd = open(device, O_RDWR);
-	if (fd < 0)
-		pabort("can't open device");
-
-	/*
-	 * spi mode
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
-	if (ret == -1)
-		pabort("can't set spi mode");
-
-	ret = ioctl(fd, SPI_IOC_RD_MODE, &mode);
-	if (ret == -1)
-		pabort("can't get spi mode");
-
-	/*
-	 * bits per word
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't set bits per word");
+	// Self test does not need the device
+	if (optind < argc && strcmp(argv[optind], "selftest") == 0)
+		exit(x10_selftest() ? 1 : 0);
+
+	if (optind < argc && strcmp(argv[optind], "simulator") == 0) {
+		if (strncmp(devices[0], SPI_SOCKET_PREFIX,
+			strlen(SPI_SOCKET_PREFIX)) != 0)
+			fail("The simulator needs a " SPI_SOCKET_PREFIX
+				" device");
+		fwsim_init(mains_hz, emulate < 0 ? 0 : emulate);
+		spi_transport_serve(devices[0] + strlen(SPI_SOCKET_PREFIX));
+	}
 
-	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't get bits per word");
+	if (emulate >= 0) {
+		// There is a single simulator in the process
+		if (ndevices > 1)
+			fail("The simulator is a single device");
+		fwsim_init(mains_hz, emulate);
+	}
 
-	/*
-	 * max speed hz
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		pabort("can't set max speed hz");
+	// The daemon opens every device in a thread of its own
+	if (optind < argc && strcmp(argv[optind], "daemon") == 0)
+		return -1;
+	if (ndevices > 1)
+		fail("Only the daemon drives several devices");
 
-	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &rspeed);
-	if (ret == -1)
-		pabort("can't get max speed hz");
-	plog(2, "spi mode: %d\n", mode);
-	plog(2, "bits per word: %d\n", bits);
-	plog(2, "max speed: %d Hz (%d KHz)\n", rspeed, rspeed/1000);
-
-	return fd;
+	return x10_device_open(devices[0]);
 }
 
 int main(int argc, char *argv[])
 {
 	int fd;
-	struct spi_message spi_tx_msg;
 	struct spi_message spi_rx_msg;
-	struct x10_command a_cmd;
-	int ret;
-
+	struct x10_command cmds[X10_BATCH_COMMANDS];
+	int results[X10_BATCH_COMMANDS];
+	const char *err;
+	int ret, count, i;
 
 	fd = init(argc, argv);
 
@@ -1002,31 +2479,50 @@ int main(int argc, char *argv[])
 				plog(0, "Poll has succeeded, the result follows\n");
 			log_spi_message(0, &spi_rx_msg);
 		} else if (strcmp(argv[optind], "listenraw") == 0) {
-			feed_bit_callback = &x10_print_bit;
-			commit_x10_callback = &display_x10_command;
+			feed_octet_callback = &x10_print_octet;
+			flush_bits_callback = &x10_print_gap;
 			spi_x10_listen(fd);
 		} else if (strcmp(argv[optind], "listen") == 0) {
-			feed_bit_callback = &x10_decode_bit;
-			commit_x10_callback = &display_x10_command;
+			feed_octet_callback = &x10_decode_octet;
+			flush_bits_callback = &x10_decode_flush;
+			x10_decode_init(&display_x10_command, NULL);
 			spi_x10_listen(fd);
 		} else if (strcmp(argv[optind], "cm11") == 0) {
-			cm11(fd);
+			cm11(fd, cm11_ptys);
+		} else if (strcmp(argv[optind], "daemon") == 0) {
+			x10_daemon(devices, ndevices ? ndevices : 1,
+				socket_path, spi_trx_target);
 		} else {
-			// this must be an "direct X10 command"
-			parse_command(argv[optind], &a_cmd);
-			prepare_x10_transmit(&spi_tx_msg, &a_cmd);
+			// this must be a run of "direct X10 commands"
+			for (count = 0; optind + count < argc
+				&& count < X10_BATCH_COMMANDS; count++) {
+				if (strchr(argv[optind + count], ':') == NULL)
+					break;
+				err = parse_command(argv[optind + count],
+					&cmds[count]);
+				if (err)
+					fail(err);
+			}
+			if (count == 0) {
+				err = parse_command(argv[optind], &cmds[0]);
+				fail(err ? err : "Command not understood");
+			}
 
-			ret = reliable_spi_transfer(fd, &spi_tx_msg, &spi_rx_msg, 
-				spi_trx_target);
-			if (!ret)
-				plog(0, "Transaction has failed!\n");
-			else
-				plog(0, "Transaction has succeeded\n");
+			transmit_x10_batch(fd, cmds, count, spi_trx_target,
+				results);
+			for (i = 0; i < count; i++) {
+				if (!results[i])
+					plog(0, "Transaction has failed!\n");
+				else
+					plog(0, "Transaction has succeeded\n");
+			}
+			optind += count - 1;
 		}
 		optind++;
 	}
 
-	close(fd);
+	x10_prediction_log(1);
+	x10_device_close(fd);
 
 	return 0;
 }
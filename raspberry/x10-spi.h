@@ -32,6 +32,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 // Maximum is 32 due to stream_tail size, but RAM restricts it further
 #define X10_BITSTREAM_OCTETS 24
@@ -45,17 +46,72 @@ struct __attribute__((__packed__)) spi_message {
 	uint8_t rr_code;
 	uint8_t rr_id;
 	struct x10_bitstream x10_data;
+	uint16_t rx_seq; // received bits counter, wraps around
 	uint16_t crc16;
 };
 
 #define SPI_REQUEST_POLL 0
 #define SPI_REQUEST_CANCEL 1
 #define SPI_REQUEST_TRANSMIT 2
+#define SPI_REQUEST_DELTA 3
+
+// DELTA reply: rr_code, rr_id, rx_seq, count, data[count], crc16
+#define SPI_DELTA_HEADER 5
+#define SPI_DELTA_MAX_OCTETS (X10_BITSTREAM_OCTETS-1)
+
+// Only modules built with X10_DECODE answer this
+#define SPI_REQUEST_COMMANDS 4
+
+// COMMANDS reply: rr_code, rr_id, record counter, first record, count,
+// records[count], crc16
+#define SPI_COMMANDS_HEADER 5
+#define SPI_COMMANDS_MAX 6
+#define SPI_RECORD_OCTETS 4
+
+// Record: code (house << 4 | unit or function), flags, x_byte_1, x_byte_2
+#define SPI_RECORD_FUNCTION 0x80
+#define SPI_RECORD_EXTENDED 0x40	// code holds the unit
+#define SPI_RECORD_REPEATS 0x3F
+
+// SEND request: a single command, expanded into frames by the module.
+// Only sizeof(struct spi_send) octets are clocked.
+#define SPI_REQUEST_SEND 5
+
+struct __attribute__((__packed__)) spi_send {
+	uint8_t rr_code;
+	uint8_t rr_id;
+	uint8_t code;		// house << 4 | unit, as on the line
+	uint8_t function;	// function << 4 | SPI_SEND_STICKY, as on the line
+	uint8_t addr_rpt;
+	uint8_t func_rpt;
+	uint8_t x_byte_1;
+	uint8_t x_byte_2;
+	uint16_t crc16;
+};
+
+#define SPI_SEND_STICKY 0x01	// no pause after the function frames
+
+// QUEUE reply: rr_code, rr_id, slots, free slots, count,
+// count * (rr_id, response code), crc16
+#define SPI_REQUEST_QUEUE 6
+#define SPI_QUEUE_HEADER 5
+#define SPI_QUEUE_MAX 8
+#define SPI_QUEUE_ENTRY_OCTETS 2
 
 #define SPI_RESPONSE_SEEN 1
 #define SPI_RESPONSE_INPROGRESS 2
 #define SPI_RESPONSE_COMPLETE 3
 
+// Segments of a chained SPI transaction, see spi_transfer_chain()
+#define SPI_MAX_SEGMENTS 4
+
+struct spi_segment {
+	const void *tx;
+	void *rx;
+	int len;
+	int wait_us;	// time for the module to process this segment
+};
+
 extern const uint8_t _x10_code[];
 
 extern const uint8_t _x10_decode[];
@@ -79,6 +135,10 @@ extern const char *_x10_function[];
 #define X10_FUNC_EXTENDEDCODE	8
 #define X10_FUNC_EXTENDEDDATA	15
 
+// Commands and messages in a single transmit batch
+#define X10_BATCH_COMMANDS 32
+#define X10_BATCH_MESSAGES 32
+
 struct x10_command {
 	int hc;
 	int uc;
@@ -90,13 +150,82 @@ struct x10_command {
 	int sticky;
 };
 
-extern void (*feed_bit_callback)(uint8_t);
-extern void (*commit_x10_callback)(struct x10_command*);
-void x10_decode_bit(uint8_t bit);
-void prepare_x10_transmit(struct spi_message *msg, struct x10_command *p_cmd);
+struct x10_prediction_stats {
+	int samples;
+	long long sum_error_us;
+	long max_early_us;
+	long max_late_us;
+};
+
+struct x10_rx_stats {
+	long polls;
+	long bits;
+	int max_fill;
+	int64_t first_us;
+	long long latency_sum_us;	// age of the oldest new bit, summed
+	long max_latency_us;
+	long overruns;
+	long lost_bits;
+	long delta_polls;	// polls answered by a DELTA reply
+	long record_polls;	// polls answered by a COMMANDS reply
+	long lost_records;
+	long long spi_octets;	// octets clocked by receive polls
+};
+
+// SEND commands queued in the module, the one in transmission first
+struct spi_queue_state {
+	int slots;	// size of the queue
+	int free;	// slots free, 0 while a TRANSMIT bitstream is sent
+	int count;
+	uint8_t rr_id[SPI_QUEUE_MAX];
+	uint8_t code[SPI_QUEUE_MAX];	// SPI_RESPONSE_*
+};
+
+struct x10_link_stats {
+	long replies;		// replies of the module checked
+	long crc_errors;	// of them damaged
+};
+
+// Devices a single daemon drives
+#define X10_MAX_DEVICES 8
+
+int x10_device_open(const char *device);
+void x10_device_close(int fd);
+
+// Per thread, as the decoders of the daemon devices
+extern __thread void (*feed_octet_callback)(uint8_t);
+extern __thread void (*flush_bits_callback)(void);
+void x10_decode_init(void (*commit)(void *data, struct x10_command *cmd),
+	void *data);
+void x10_decode_octet(uint8_t octet);
+void x10_decode_flush(void);
+const char *parse_command(const char* orig_cmd, struct x10_command* p_cmd);
+const char *check_command(const struct x10_command *p_cmd);
+int prepare_x10_batch(int fd, struct spi_message *msgs, int max_msgs,
+	struct x10_command *cmds, int count, int *cmd_msg);
+int spi_message_bits(const struct spi_message *msg);
+void transmit_x10_batch(int fd, struct x10_command *cmds, int count,
+	int target, int *results);
+int checked_spi_receive(int fd, struct spi_message *spi_rx_msg);
+int spi_queue_receive(int fd, struct spi_queue_state *st);
+int spi_send_request(int fd, struct spi_message *spi_tx_msg,
+	struct spi_message *spi_rx_msg);
 int reliable_spi_transfer(int fd, struct spi_message *spi_tx_message,
         struct spi_message *spi_rx_message, int target_code );
-void spi_x10_poll(int fd);
+int spi_x10_poll(int fd);
+long x10_rx_delay(void);
+void x10_rx_stats_get(struct x10_rx_stats *st);
+void x10_rx_stats_log(int level);
+void x10_link_stats_get(struct x10_link_stats *st);
+
+int64_t monotonic_us(void);
+int64_t x10_bits_us(int bits);
+int64_t x10_predict_completion(int64_t start_us, int bits);
+long x10_completion_delay(int64_t due_us);
+void sleep_ms(long ms);
+void x10_prediction_record(int64_t predicted_us, int64_t actual_us);
+void x10_prediction_get(struct x10_prediction_stats *st);
+void x10_prediction_log(int level);
 
 void fail(const char *s);
 void plog(int level, char *str, ...);